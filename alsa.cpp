@@ -1,77 +1,31 @@
 #ifndef _MSC_VER
 
 #include <alsa/asoundlib.h>
+#include <algorithm>
+#include <atomic>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+// Playback engine.  alsaRun() is the audio thread's whole life:
+// whenever the soundcard has room for a period, it asks a callback to fill that room,
+// preferably right in the soundcard's mmap'ed buffer.
+// That thread has realtime priority, and neither allocates nor locks.
 
 const char *device = "default"; /* playback device */
-const snd_pcm_format_t format = SND_PCM_FORMAT_S16; /* sample format */
-const unsigned int rate = 16000; /* stream rate */
+const snd_pcm_format_t format = SND_PCM_FORMAT_S16; /* sample format, native endian like the caller's shorts */
+unsigned int rate = 16000; /* stream rate:  alsaInit's, or else the nearest the device supports */
 const unsigned int channels = 1; /* count of channels */
 
 unsigned int buffer_time = 30000; /* ring buffer length in us: 2x or 3x period_time. */
-unsigned int period_time = 15000; /* period time in us */
+unsigned int period_time = 10000; /* period time in us */
 snd_pcm_sframes_t buffer_size;
 snd_pcm_sframes_t period_size;
+bool fMmap = false; /* SND_PCM_ACCESS_MMAP_INTERLEAVED, else RW */
 
 snd_output_t *output = NULL;
 
-void emit_samples(const snd_pcm_channel_area_t *areas,
-                          snd_pcm_uframes_t offset,
-                          int count, const short* ps, ssize_t cb)
-{
-    // ;;;; cb and count are duplicates.
-#define fast_and_dangerous
-#ifdef fast_and_dangerous
-    const int format_bits = 16;
-    const int bps = 2;
-    const int phys_bps = 2;
-    const bool big_endian = false;
-    const bool to_unsigned = false;
-#else
-    const int format_bits = snd_pcm_format_width(format);
-    const int bps = format_bits / 8; /* bytes per sample */
-    const int phys_bps = snd_pcm_format_physical_width(format) / 8;
-    const int big_endian = snd_pcm_format_big_endian(format) == 1;
-    const int to_unsigned = snd_pcm_format_unsigned(format) == 1;
-#endif
-
-    unsigned char *samples[channels];
-    int steps[channels];
-
-    /* verify and prepare the contents of areas */
-    unsigned int chn;
-    for (chn = 0; chn < channels; chn++) {
-        if ((areas[chn].first % 8) != 0) {
-            printf("areas[%u].first == %u, aborting...\n", chn, areas[chn].first);
-            exit(EXIT_FAILURE);
-        }
-        samples[chn] = /*(signed short *)*/(((unsigned char *)areas[chn].addr) + (areas[chn].first / 8));
-        if ((areas[chn].step % 16) != 0) {
-            printf("areas[%u].step == %u, aborting...\n", chn, areas[chn].step);
-            exit(EXIT_FAILURE);
-        }
-        steps[chn] = areas[chn].step / 8;
-        samples[chn] += offset * steps[chn];
-    }
-
-    /* fill the channel areas */
-    while (count-- > 0) {
-	int res = int(*ps++);
-        if (to_unsigned)
-            res ^= 1U << (format_bits - 1);
-        for (chn = 0; chn < channels; chn++) {
-            /* Generate data in native endian format */
-            if (big_endian) {
-                for (int i = 0; i < bps; i++)
-                    *(samples[chn] + phys_bps - 1 - i) = (res >> i * 8) & 0xff;
-            } else {
-                for (int i = 0; i < bps; i++)
-                    *(samples[chn] + i) = (res >> i * 8) & 0xff;
-            }
-            samples[chn] += steps[chn];
-        }
-    }
-}
 static int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *params, snd_pcm_access_t access)
 {
     /* choose all parameters */
@@ -80,9 +34,8 @@ static int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *params, snd_pcm_
         printf("Broken configuration for playback: no configurations available: %s\n", snd_strerror(err));
         return err;
     }
-    /* set hardware resampling */
-    // Report back from alsa to timeliner the *actual* sampling rate?
-    err = snd_pcm_hw_params_set_rate_resample(handle, params, 1);
+    /* no ALSA resampling, of unknown quality:  timeliner's Resampler converts to whatever rate the device has */
+    err = snd_pcm_hw_params_set_rate_resample(handle, params, 0);
     if (err < 0) {
         printf("Resampling setup failed for playback: %s\n", snd_strerror(err));
         return err;
@@ -113,8 +66,8 @@ static int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *params, snd_pcm_
         return err;
     }
     if (rrate != rate) {
-        printf("Rate doesn't match (requested %u Hz, got %u Hz)\n", rate, rrate);
-        return -EINVAL;
+        printf("timeliner ALSA resampling from %u Hz to the device's %u Hz.\n", rate, rrate);
+        rate = rrate;
     }
     /* set the buffer time */
     int dir = 0;
@@ -204,33 +157,22 @@ static int xrun_recovery(snd_pcm_t *handle, int err)
 }
 
 int alsaBuf() { return period_size; }
+unsigned alsaRate() { return rate; }
 
-void write_loop(snd_pcm_t *handle, signed short *samples, snd_pcm_channel_area_t *areas,
-	const short* ps, ssize_t cb)
+static signed short *samples = NULL; /* one period, for RW access or for a noncontiguous mmap area */
+static snd_pcm_t *handle = NULL;
+
+// Let the audio thread preempt everything else, so the GUI building mipmaps can't starve it.
+// Needs rtprio in /etc/security/limits.conf, or CAP_SYS_NICE.  Without that, just a warning.
+static void makeRealtime()
 {
-    emit_samples(areas, 0, period_size, ps, cb);
-	signed short *ptr = samples;
-        int cptr = period_size;
-        while (cptr > 0) {
-            const int err = snd_pcm_writei(handle, ptr, cptr);
-            if (err == -EAGAIN)
-                continue;
-            if (err < 0) {
-                if (xrun_recovery(handle, err) < 0) {
-                    printf("Write error: %s\n", snd_strerror(err));
-                    exit(EXIT_FAILURE);
-                }
-                break; /* skip one period */
-            }
-            ptr += err * channels;
-            cptr -= err;
-        }
+    sched_param param;
+    param.sched_priority = std::min(70, sched_get_priority_max(SCHED_FIFO));
+    const int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err != 0)
+        printf("timeliner ALSA Warning: no realtime priority for audio: %s\n", strerror(err));
 }
 
-static signed short *samples = NULL;
-static snd_pcm_channel_area_t *areas = NULL;
-static snd_pcm_t *handle = NULL;
-
 void alsaInit(const unsigned SR)
 {
     setenv("ALSA_CARD", "0", 1);
@@ -241,50 +183,140 @@ void alsaInit(const unsigned SR)
         printf("timeliner ALSA Output failed: %s\n", snd_strerror(err));
         return;
     }
-    if (SR != rate)
-      printf("timeliner ALSA Warning: ALSA playback overriding requested sample rate of %u Hz with hardcoded %u Hz.\n", SR, rate);
+    rate = SR; // The file's own rate, if the device supports it.
     printf("timeliner ALSA Playback device is %s\n", device);
     printf("Stream parameters are %u Hz, %s, %u channels\n", rate, snd_pcm_format_name(format), channels);
     if ((err = snd_pcm_open(&handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
         printf("timeliner ALSA Playback open error: %s\n", snd_strerror(err));
+        handle = NULL;
         return;
     }
-    if ((err = set_hwparams(handle, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
-        printf("timeliner ALSA Setting of hwparams failed: %s\n", snd_strerror(err));
-        exit(EXIT_FAILURE);
+    fMmap = set_hwparams(handle, hwparams, SND_PCM_ACCESS_MMAP_INTERLEAVED) >= 0;
+    if (!fMmap) {
+        printf("timeliner ALSA mmap unavailable, falling back to writei.\n");
+        if ((err = set_hwparams(handle, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
+            printf("timeliner ALSA Setting of hwparams failed: %s\n", snd_strerror(err));
+            exit(EXIT_FAILURE);
+        }
     }
     if ((err = set_swparams(handle, swparams)) < 0) {
         printf("timeliner ALSA Setting of swparams failed: %s\n", snd_strerror(err));
         exit(EXIT_FAILURE);
     }
+    // Allocate now, not in alsaRun().
     samples = (short int*)malloc((period_size * channels * snd_pcm_format_physical_width(format)) / 8);
     if (samples == NULL) {
         printf("timeliner ALSA Out of memory\n");
         exit(EXIT_FAILURE);
     }
-    areas = (snd_pcm_channel_area_t*)calloc(channels, sizeof(snd_pcm_channel_area_t));
-    if (areas == NULL) {
-        printf("timeliner ALSA Out of memory\n");
-        exit(EXIT_FAILURE);
-    }
-    unsigned int chn;
-    for (chn = 0; chn < channels; chn++) {
-        areas[chn].addr = samples;
-        areas[chn].first = chn * snd_pcm_format_physical_width(format);
-        areas[chn].step = channels * snd_pcm_format_physical_width(format);
-    }
 }
 
-void alsaTick(const short* ps, ssize_t cb)
+// Where frame "offset" of a mono S16 area starts, if its frames are adjacent shorts.  Else NULL.
+static short* contiguous(const snd_pcm_channel_area_t& area, snd_pcm_uframes_t offset)
+{
+    if (area.first % 16 != 0 || area.step != 16)
+        return NULL;
+    return (short*)area.addr + area.first / 16 + offset;
+}
+
+// Until fQuit, call fill(dst, n) to get each next n samples.
+// If fRestart becomes true, e.g. when playback starts, first discard what's queued but not yet played,
+// so the new sound starts within about a period, not after the whole buffer.
+void alsaRun(void (*fill)(short*, int), const bool& fQuit, std::atomic<bool>& fRestart)
 {
-  write_loop(handle, samples, areas, ps, cb);
+    if (!handle)
+        return;
+    makeRealtime();
+    while (!fQuit) {
+        if (fRestart.exchange(false)) {
+            // Keep a period queued, lest rewinding underrun.
+            const snd_pcm_sframes_t frames = snd_pcm_rewindable(handle) - period_size;
+            if (frames > 0)
+                (void)snd_pcm_rewind(handle, frames);
+        }
+
+        if (!fMmap) {
+            fill(samples, period_size);
+            signed short *ptr = samples;
+            int cptr = period_size;
+            while (cptr > 0) {
+                const int err = snd_pcm_writei(handle, ptr, cptr); // blocks
+                if (err == -EAGAIN)
+                    continue;
+                if (err < 0) {
+                    if (xrun_recovery(handle, err) < 0) {
+                        printf("Write error: %s\n", snd_strerror(err));
+                        exit(EXIT_FAILURE);
+                    }
+                    break; /* skip one period */
+                }
+                ptr += err * channels;
+                cptr -= err;
+            }
+            continue;
+        }
+
+        const snd_pcm_sframes_t avail = snd_pcm_avail_update(handle);
+        if (avail < 0) {
+            if (xrun_recovery(handle, avail) < 0) {
+                printf("timeliner ALSA avail update failed: %s\n", snd_strerror(avail));
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+        if (avail < period_size) {
+            // Sleep until there's room for a period.  Before the stream starts, the first commit fills the buffer, which starts it.
+            const int err = snd_pcm_wait(handle, 1000);
+            if (err < 0 && xrun_recovery(handle, err) < 0) {
+                printf("timeliner ALSA wait failed: %s\n", snd_strerror(err));
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+
+        // Fill one period, in one or two pieces if the mmap area wraps around.
+        snd_pcm_uframes_t left = period_size;
+        while (left > 0) {
+            const snd_pcm_channel_area_t *areas;
+            snd_pcm_uframes_t offset;
+            snd_pcm_uframes_t frames = left;
+            int err = snd_pcm_mmap_begin(handle, &areas, &offset, &frames);
+            if (err < 0) {
+                if (xrun_recovery(handle, err) < 0) {
+                    printf("timeliner ALSA mmap begin failed: %s\n", snd_strerror(err));
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            short* dst = contiguous(areas[0], offset);
+            if (dst) {
+                fill(dst, frames); // Straight into the soundcard's buffer.
+            } else {
+                fill(samples, frames);
+                unsigned char* pb = (unsigned char*)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+                for (snd_pcm_uframes_t i=0; i<frames; ++i, pb += areas[0].step / 8)
+                    *(short*)pb = samples[i];
+            }
+            const snd_pcm_sframes_t committed = snd_pcm_mmap_commit(handle, offset, frames);
+            if (committed < 0 || snd_pcm_uframes_t(committed) != frames) {
+                if (xrun_recovery(handle, committed >= 0 ? -EPIPE : committed) < 0) {
+                    printf("timeliner ALSA mmap commit failed: %s\n", snd_strerror(committed));
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            left -= frames;
+        }
+    }
 }
 
 void alsaTerm()
 {
-    free(areas);
+    if (handle) {
+        snd_pcm_drop(handle);
+        snd_pcm_close(handle);
+    }
     free(samples);
-    snd_pcm_close(handle);
 }
 
 #endif
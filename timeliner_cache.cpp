@@ -7,6 +7,7 @@
 
 #include "timeliner_cache.h"
 #include "timeliner_util.h"
+#include "timeliner_util_threads.h" // WorkerPool::stopRequested()
 
 #undef VERBOSE
 
@@ -34,7 +35,8 @@ CHello::CHello(const float* const aSrc, const long cs, const Float hzArg, const
   hz(hzArg),
   width(widthArg),
   czNode(3 + 3*width), // tMin tMax numEls, width* { zMin zMean zMax }.
-  cb(0)
+  cb(0),
+  fStopped(false)
 {
   if (SUB < 1) {
     std::cout << "error: nonpositive cache undersampler.\n";
@@ -87,6 +89,10 @@ CHello::CHello(const float* const aSrc, const long cs, const Float hzArg, const
     // Both tests are needed, lest pz overflow.  (Compiler bug??)
     unsigned c;
     for (c=0; iSrc != iSrcMax && pz != pzMax; ++c) {
+      if ((c & 0xfffff) == 0 && WorkerPool::stopRequested()) {
+	fStopped = true;
+	return;
+      }
 #ifndef NDEBUG
 #ifndef _MSC_VER
 	    // VS2013 only got std::isnormal in July 2013:
@@ -103,16 +109,21 @@ CHello::CHello(const float* const aSrc, const long cs, const Float hzArg, const
     unsigned long is = 0;
     int iLeaf = 0;
     int percentPrev = 0;
-    while (iSrc != iSrcMax && pz != pzMax) {
+    for (unsigned c=0; iSrc != iSrcMax && pz != pzMax; ++c) {
+      if ((c & 0xffff) == 0 && WorkerPool::stopRequested()) {
+	fStopped = true;
+	return;
+      }
       // Compute tMin and tMax with the same expression,
       // so they're exactly binary == from one node to the next.
       *pz++ = TFromIleaf(is, hz);
       is += SUB;
       *pz++ = TFromIleaf(is, hz);
 
-      static Float zMin[CQuartet_widthMax];
-      static double zMean[CQuartet_widthMax]; // avoid roundoff error
-      static Float zMax[CQuartet_widthMax];
+      // Not static, so several CHellos can be built at once.
+      Float zMin[CQuartet_widthMax];
+      double zMean[CQuartet_widthMax]; // avoid roundoff error
+      Float zMax[CQuartet_widthMax];
       for (unsigned _=0; _<width; _++) {
 	zMin[_] = 1e9;
 	zMean[_] = 0.0;
@@ -150,6 +161,10 @@ CHello::CHello(const float* const aSrc, const long cs, const Float hzArg, const
   }
 
   while (layers->back()->size() > czNode) {
+    if (WorkerPool::stopRequested()) {
+      fStopped = true;
+      return;
+    }
     const VD& L = *layers->back(); // Read previous layer.
 
     // A Twig is a non-leaf node.  Perhaps cNode is more readable than cTwig?
@@ -329,7 +344,8 @@ CHello::CHello(const short* const aSrc, const long cs, const Float hzArg, const
   hz(hzArg),
   width(widthArg),
   czNode(3 + 3*width), // tMin tMax numEls, width* { zMin zMean zMax }.
-  cb(0)
+  cb(0),
+  fStopped(false)
 {
   if (SUB < 1) {
     std::cout << "error: nonpositive cache undersampler.\n";
@@ -403,9 +419,10 @@ CHello::CHello(const short* const aSrc, const long cs, const Float hzArg, const
       is += SUB;
       *pz++ = TFromIleaf(is, hz);
 
-      static Float zMin[CQuartet_widthMax];
-      static double zMean[CQuartet_widthMax]; // avoid roundoff error
-      static Float zMax[CQuartet_widthMax];
+      // Not static, so several CHellos can be built at once.
+      Float zMin[CQuartet_widthMax];
+      double zMean[CQuartet_widthMax]; // avoid roundoff error
+      Float zMax[CQuartet_widthMax];
       for (unsigned _=0; _<width; _++) {
 	zMin[_] = 1e9;
 	zMean[_] = 0.0;
@@ -851,7 +868,7 @@ static void RgbFromMMM(Float* a, int iColormap)
   RgbFromHsv(a);
 }
 
-static Float ByteFromMMM(const Float* a, int iColormap)
+Float ByteFromMMM(const Float* a, int iColormap)
 {
   switch (iColormap) {
     case 5: // waveform for shader
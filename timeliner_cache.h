@@ -123,6 +123,8 @@ public:
   CHello(const short* const aSrc, const long cs, const Float hz, const unsigned SUB, const int width);
   CHello(const float* const aSrc, const long cs, const Float hz, const unsigned SUB, const int width);
   ~CHello();
+  // The task building it was cancelled, so it's incomplete and mustn't be used.
+  bool stopped() const { return fStopped; }
 
   void getbatch(float* dst, const double t0, const double t1, const unsigned cstep, const double dyMin) const;
   void getbatchMMM(unsigned char* r, double t0, double t1, int jMax, unsigned cstep, int iColormap) const;
@@ -136,6 +138,10 @@ private:
   const unsigned width;
   const unsigned czNode;
   long cb;
+  bool fStopped;
 
   const CQuartet recurse(const std::vector<VD*>* const layers, const Float s, const Float t, const int iLayer, const unsigned iz) const;
 };
+
+// A texel's min, mean and max as one value in 0..1, as getbatchByte() conflates them.
+Float ByteFromMMM(const Float* mmm, int iColormap);
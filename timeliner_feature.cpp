@@ -1,81 +1,54 @@
 #include "timeliner_feature.h"
 #include "timeliner_diagnostics.h"
+#include "timeliner_gpumem.h"
+#include "timeliner_marshal.h"
+#include "timeliner_mipmap.h"
 #include "timeliner_util.h"
 #include "timeliner_util_threads.h"
+#include <algorithm>
 #include <cstring>
 #include <cstdio>
 #include <cmath>
 
-float gpuMBavailable()
-{
-  // glerror GL_OUT_OF_MEMORY ?
-  // kernel: [4391985.748987] NVRM: VM: nv_vm_malloc_pages: failed to allocate contiguous memory
-
-  // http://developer.download.nvidia.com/opengl/specs/GL_NVX_gpu_memory_info.txt
-  // AMD/ATI equivalent: WGL_AMD_gpu_association wglGetGPUIDsAMD wglGetGPUIDsAMD wglGetGPUInfoAMD
-  // www.opengl.org/registry/specs/ATI/meminfo.txt
-#if 0
-  #define GPU_MEMORY_INFO_DEDICATED_VIDMEM_NVX 0x9047
-  GLint total_mem_kb = 0;
-  glGetIntegerv(GPU_MEMORY_INFO_DEDICATED_VIDMEM_NVX, &total_mem_kb);
-#endif
-  #define GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX 0x9049
-  GLint cur_avail_mem_kb = 0;
-  glGetIntegerv(GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX, &cur_avail_mem_kb);
-  return cur_avail_mem_kb/1000.0F;
-
-  // A feature of width 65536 (almost 11 minutes at 100 samples/sec)
-  // uses ~145 MB texture RAM.
-  // That's 8 chunks of width 8192.
-  // 1 chunk is 8192x1 texels * 2 for mipmap * 3 for GL_RGB * 62 vectorsize = 3047424 B = 2.9MB;
-  // 8 chunks is 23 MB.  But 145MB is used?!  (RGBA not just RGB?)
-}
-
-Feature::Feature(int /*iColormap*/, const std::string& filename, const std::string& dirname): m_fValid(false) {
-  if (mb == mbUnknown) {
-    mb = gpuMBavailable() > 0.0f ? mbPositive : mbZero;
-    if (!hasGraphicsRAM())
-      warn("Found no dedicated graphics RAM.  Might run slowly.");
-  }
-  const Mmap marshaled_file(dirname + "/" + filename);
-  if (!marshaled_file.valid())
+// Only maps the marshal file and reads its header.  load() builds the textures.
+Feature::Feature(int /*iColormap*/, const std::string& filename, const std::string& dirname): cchunk(0), levels(0), m_fValid(false), m_fLoaded(false), m_fCompressed(false), m_mipfile(dirname + "/" + filename + ".mip"), m_marshaled(NULL), m_mip(NULL), m_mipLevelSkip(0), m_cacheHTK(NULL), m_subsample(1), m_home(-1) {
+  // Keep this open until m_cacheHTK is built from it, maybe by another thread.
+  m_marshaled = new Mmap(dirname + "/" + filename);
+  if (!m_marshaled->valid())
     return;
-  binaryload(marshaled_file.pch(), marshaled_file.cch()); // stuff many member variables
-  makeMipmaps();
+  binaryload(m_marshaled->pch(), m_marshaled->cch()); // stuff many member variables
   m_fValid = true;
-  // ~Mmap closes file
+}
+
+// Only starts building the feature's textures, and never waits for the pool.
+// Each chunk is drawable once its eager levels are uploaded, during later calls to pool.runMain() or pool.wait().
+void Feature::load(WorkerPool& pool) {
+  assert(m_fValid);
+  if (m_fLoaded)
+    return;
+  makeMipmaps(m_mipfile, pool);
+  m_fLoaded = true;
+}
+
+Feature::~Feature() {
+  delete m_marshaled;
+  delete m_mip;
+  delete m_cacheHTK;
 }
 
 void Feature::binaryload(const char* pch, long cch) {
   assert(4 == sizeof(float));
-  strcpy(m_name, pch);				pch += strlen(m_name);
-  m_iColormap = int(*(float*)pch);		pch += sizeof(float);
-  m_period = *(float*)pch;			pch += sizeof(float);
-  const int slices = int(*(float*)pch);	pch += sizeof(float);
-  m_vectorsize = int(*(float*)pch);		pch += sizeof(float);
-  m_pz = (const float*)pch; // m_cz floats.  Not doubles.
-  m_cz = (cch - long(strlen(m_name) + 4*sizeof(float))) / 4;
+  const MarshalHeader& h = *(const MarshalHeader*)pch;
+  if (!h.valid(cch))
+    quit("binaryload: corrupt or obsolete marshal file; rerun timeliner_pre");
+  m_name.assign(pch + sizeof(h), h.nameLength);
+  m_iColormap = h.iColormap;
+  m_period = h.period;
+  m_vectorsize = h.vectorsize;
+  m_pz = (const float*)(pch + h.offData); // m_cz floats.  Not doubles.
+  m_cz = long(h.cz());
 #ifndef NDEBUG
-  printf("debugging feature: name %s, colormap %d, period %f, slices %d, width %d, cz %lu.\n", m_name, m_iColormap, m_period, slices, m_vectorsize, m_cz);
-#endif
-  if (m_iColormap<0 || m_period<=0.0 || slices<=0 || m_vectorsize<=0) {
-    quit("binaryload: feature '" + std::string(m_name) + "' has corrupt data");
-  }
-  assert(slices*m_vectorsize == m_cz);
-#ifdef NDEBUG
-  _unused(slices);
-#else
-
-#ifndef _MSC_VER
-      // VS2013 only got std::isnormal and std::fpclassify in July 2013:
-      // http://blogs.msdn.com/b/vcblog/archive/2013/07/19/c99-library-support-in-visual-studio-2013.aspx
-      for (int i=0; i<m_cz; ++i) {
-  if (!std::isnormal(m_pz[i]) && m_pz[i] != 0.0) {
-      printf("binaryload: feature's float %d of %ld is bogus: class %d, value %f\n", i, m_cz, std::fpclassify(m_pz[i]), m_pz[i]);
-      quit("");
-    }
-  }
-#endif
+  printf("debugging feature: name %s, colormap %d, period %f, slices %ld, width %d, cz %ld.\n", m_name.c_str(), m_iColormap, m_period, long(h.slices), m_vectorsize, m_cz);
 #endif
 }
 
@@ -94,141 +67,429 @@ void prepTextureMipmap(const GLuint t)
   glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
   //needed? glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_PRIORITY, 0.99);
 }
+
+// RGTC can't compress 1D textures, so each compressed mipmap level is its own 2D texture,
+// one row per element of the feature's vector.
+void prepTextureLevel(const GLuint t)
+{
+  glBindTexture(GL_TEXTURE_2D, t);
+  assert(glIsTexture(t) == GL_TRUE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+}
 	
 
-arLock lockQueue;
-std::vector<QueueElement> queueChunk; // ;;;; rename queue to vector
+unsigned Feature::frame = 0;
+
+extern double tShowBound[2];
+
+// Which level of these mipmaps, precomputed by timeliner_pre, is this GPU's level 0 for this feature, or -1 if none is.
+// timeliner_pre subsamples only by timeliner_zoom, but makeMipmaps may subsample this feature more, to fit in graphics RAM.
+// Then its level 0 is a coarser precomputed level, because widths are powers of two.
+int Feature::mipmapLevelSkip(const Mmap& mip, const std::string& mipfile, const unsigned width, const int widthLim) const {
+  if (!mip.valid() || mip.cch() < off_t(sizeof(MipmapHeader)))
+    return -1;
+  const MipmapHeader& h = *(const MipmapHeader*)mip.pch();
+  if (!h.valid()) {
+    warn("ignoring corrupt or obsolete precomputed mipmaps " + mipfile);
+    return -1;
+  }
+  if (!(h.width == int(mipmapWidth(samples(), h.subsample)) &&
+      h.vectorsize == m_vectorsize &&
+      h.iColormap == m_iColormap &&
+      h.tBound[0] == tShowBound[0] &&
+      h.tBound[1] == tShowBound[1] &&
+      mip.cch() >= off_t(sizeof(MipmapHeader) + h.payload())))
+    return -1;
+  if (h.width < int(width)) {
+    warn("ignoring precomputed mipmaps " + mipfile + ", subsampled " + std::to_string(h.subsample) + "x, coarser than " + std::to_string(samples()) + " samples in " + std::to_string(width) + " texels");
+    return -1;
+  }
+  int skip = 0;
+  while ((h.width >> skip) > int(width))
+    ++skip;
+  if (h.widthChunk(skip) < 1 || h.widthChunk(skip) > widthLim) {
+    warn("ignoring precomputed mipmaps " + mipfile + ", whose " + std::to_string(h.cchunk) + " chunks don't fit " + std::to_string(width) + " texels on this GPU");
+    return -1;
+  }
+  return skip;
+}
+
+// Upload now only the coarse levels, at most levelsEager of them,
+// so every chunk can be drawn at once, albeit blurry when zoomed in.
+// prefetch() makes finer levels as needed.
+const int levelsEager = 9; // Up to 256 texels per chunk.
+long cbEagerAll = 0; // Sum of all features' eagerBytes().
+unsigned cFeatures = 0; // Constructed so far.
+
+// Bytes of the levels that makeMipmaps uploads at once, at most twice the finest of them.
+long eagerBytes(const unsigned width, const int widthLim, const int vectorsize) {
+  const int cchunk = mipmapChunks(width, widthLim);
+  return 2L * cchunk * vectorsize * std::min(width/cchunk, 1u << (levelsEager-1));
+}
+
+// Build the CHello on a worker thread, so several features can load at once.
+class BuildCache : public Task {
+  Feature& _feature;
+  WorkerPool& _pool;
+  const unsigned _subsample;
+  const long _cb;
+public:
+  BuildCache(Feature& f, WorkerPool& pool, unsigned subsample, long cb) :
+    _feature(f), _pool(pool), _subsample(subsample), _cb(cb) {}
+  void work() const {
+    _feature.makeCache(_subsample);
+    _pool.release(_cb);
+  }
+  void abandon() const { _pool.release(_cb); }
+};
+
+// If cancelled partway, no cache, and requestChunk() will start another.
+void Feature::makeCache(const unsigned subsample) {
+  CHello* cache = new CHello(m_pz, m_cz, 1.0f/float(m_period), subsample, m_vectorsize);
+  if (cache->stopped()) {
+    delete cache;
+    cache = NULL;
+  }
+  m_cacheHTK = cache;
+}
+
+// Unless the pool is already holding too much RAM.
+bool Feature::buildCache(WorkerPool& pool) {
+  // About the leaves, plus the tree above them.
+  const long cb = 2L * m_cz * sizeof(Float);
+  if (!pool.tryAdmit(cb))
+    return false;
+  // Its home worker first touches, and thus on a NUMA machine locally allocates, the CHello,
+  // and then builds most of its chunks.
+  if (m_home < 0)
+    m_home = pool.home(cFeatures++);
+  m_hCache = pool.task(new BuildCache(*this, pool, m_subsample, cb), TaskHandles(), WorkerPool::priorityLow, m_home);
+  return true;
+}
+
+void Feature::makeMipmaps(const std::string& mipfile, WorkerPool& pool) {
+  GLint widthLim; // often 2048..8192, rarely 16384, never greater.
+  glGetIntegerv(GL_MAX_TEXTURE_SIZE, &widthLim);
+  assert(widthLim >= 0); // because width is unsigned
 
-void Feature::makeMipmaps() {
-  // Adaptive subsample is too tricky, until I can better predict GL_GPU_MEM_INFO_CURRENT_AVAILABLE_MEM_NVX.
-  // (Adapt the prediction itself??  Allocate a few textures of various sizes, and measure reported GL_GPU_MEM_INFO_CURRENT_AVAILABLE_MEM_NVX.  But implement this only after getting 2 or 3 different PCs to test it on.)
   // Subsampling to coarser than 100 Hz would be pretty limiting.
-  const char* pch = getenv("timeliner_zoom");
-  unsigned subsample = pch ? atoi(pch) : 1;
-  if (subsample < 1)
-    subsample = 1;
-  if (subsample > 1)
-    printf("Subsampling %ux from environment variable timeliner_zoom.\n", subsample);
-
-  const int csample = samples();
-
-  // Smallest power of two that exceeds features' # of samples.
-  unsigned width = 1;
-  while (width < csample/subsample)
-    width *= 2;
-  //printf("feature has %d samples, for tex-chunks' width %d.\n", csample, width);
-
-  // Minimize cchunk to conserve RAM and increase FPS.
-  {
-    GLint widthLim; // often 2048..8192, rarely 16384, never greater.
-    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &widthLim);
-    assert(widthLim >= 0); // because width is unsigned
-    if (width > unsigned(widthLim)) assert(width%widthLim==0);	// everything is a power of two
-    cchunk = width<unsigned(widthLim) ? 1 : width/widthLim;
-    //printf("width = %u, cchunk = %d, widthLim = %d\n", width, cchunk, widthLim);
-    if (width >= unsigned(widthLim))
-      assert(GLint(width/cchunk) == widthLim);
+  unsigned subsample = mipmapSubsample();
+  unsigned width = mipmapWidth(samples(), subsample);
+  if (mipmapSubsampleFixed()) {
+    if (subsample > 1)
+      printf("Subsampling %ux from environment variable timeliner_zoom.\n", subsample);
+  } else {
+    // Finer levels are evicted as needed, but the eager ones must fit.
+    // Leave most of gpuBudget for other features, and for finer levels.
+    // Count what previous features will upload, because they may still be loading.
+    while (width > 1 && eagerBytes(width, widthLim, m_vectorsize) > (gpuBudget.budget() - cbEagerAll) / 4) {
+      subsample *= 2;
+      width = mipmapWidth(samples(), subsample);
+    }
+    if (subsample > 1)
+      printf("Subsampling %ux to fit in graphics RAM.\n", subsample);
+  }
+  cbEagerAll += eagerBytes(width, widthLim, m_vectorsize);
+  //printf("feature has %d samples, for tex-chunks' width %d.\n", samples(), width);
+  if (width > unsigned(widthLim)) assert(width%widthLim==0);	// everything is a power of two
+
+  // Prefer mipmaps precomputed by timeliner_pre:  then no CHello is needed.
+  m_mip = new Mmap(mipfile);
+  m_mipLevelSkip = mipmapLevelSkip(*m_mip, mipfile, width, widthLim);
+  const bool fPersisted = m_mipLevelSkip >= 0;
+  if (!fPersisted) {
+    delete m_mip;
+    m_mip = NULL;
+  }
+  cchunk = fPersisted ? ((const MipmapHeader*)m_mip->pch())->cchunk : mipmapChunks(width, widthLim);
+  //printf("width = %u, cchunk = %d, widthLim = %d\n", width, cchunk, widthLim);
+  m_widthChunk = width/cchunk;
+  for (levels=0; m_widthChunk>>levels >= 1; ++levels)
+    ;
+  assert(levels <= levelLim);
+
+  if (mipmapCompress()) {
+    m_fCompressed = GLEW_ARB_texture_compression_rgtc || GLEW_EXT_texture_compression_rgtc;
+    if (!m_fCompressed)
+      warn("This GPU lacks RGTC, so timeliner_compress is ignored.");
   }
 
   rgTex.resize(cchunk);
   for (int ichunk=0; ichunk<cchunk; ++ichunk) {
-    glGenTextures(m_vectorsize, rgTex[ichunk].tex);
-    for (int j=0; j < m_vectorsize; ++j)
-      prepTextureMipmap(rgTex[ichunk].tex[j]);
+    if (m_fCompressed) {
+      glGenTextures(levels, rgTex[ichunk].texLevel);
+      for (int level=0; level < levels; ++level)
+	prepTextureLevel(rgTex[ichunk].texLevel[level]);
+    } else {
+      glGenTextures(m_vectorsize, rgTex[ichunk].tex);
+      for (int j=0; j < m_vectorsize; ++j)
+	prepTextureMipmap(rgTex[ichunk].tex[j]);
+    }
   }
+  // Nothing is uploaded yet.
+  levelBase.assign(cchunk, levels);
+  m_levelPending.assign(cchunk, levels);
+  m_uploadLast.assign(cchunk, TaskHandle());
+  m_builds.assign(cchunk, TaskHandles());
+  m_frameWanted.assign(cchunk, 0);
 
-  const CHello cacheHTK(m_pz, m_cz, 1.0f/m_period, subsample, m_vectorsize);
-  glEnable(GL_TEXTURE_1D);
-  const float mb0 = hasGraphicsRAM() ? gpuMBavailable() : 0.0f;
-  // One pool for ALL Features would be slightly faster, but risks running out of memory.
-  // However, any worker pool at all uses more memory.
-  {
-    WorkerPool pool;
-    for (unsigned level=0; (width/cchunk)>>level >= 1; ++level) {
-      //printf("  computing feature's mipmap level %d.\n", level);
-      makeTextureMipmap(cacheHTK, level, width >> level);
-    }
+  if (fPersisted)
+    info("using precomputed mipmaps " + mipfile + (m_mipLevelSkip > 0 ? ", from level " + std::to_string(m_mipLevelSkip) : std::string()));
+  else {
+    info("computing mipmaps, because none were precomputed to match " + mipfile);
+    m_subsample = subsample;
+    (void)buildCache(pool); // Else requestChunk() tries again.
   }
-  printf("finishing %lu chunks\n\n\n", queueChunk.size());
-  for (std::vector<QueueElement>::iterator it = queueChunk.begin(); it != queueChunk.end(); ++it) {
-    finishMipmap(*it);
-  }
-
-  if (hasGraphicsRAM()) {
-    const float mb1 = gpuMBavailable();
-    printf("Feature used %.1f graphics MB;  %.0f MB remaining.\n", mb0-mb1, mb1);
-    if (mb1 < 50.0) {
-#ifdef _MSC_VER
-      warn("Running out of graphics RAM.  Try increasing the environment variable timeliner_zoom to 15 or so.");
-#else
-      // Less than 50 MB free may hang X.  Mouse responsive, Xorg 100% cpu, network up, console frozen.
-      // Or, the next request may "go negative", mb0-mb1<0.
-      warn("Running out of graphics RAM.  Try export timeliner_zoom=15.");
-#endif
+
+  m_levelEager = std::max(0, levels - levelsEager);
+  glEnable(GL_TEXTURE_1D);
+  // What doesn't fit in the pool yet, prefetch() requests again once it's wanted.
+  for (int level=levels-1; level>=m_levelEager; --level)
+    for (int ichunk=0; ichunk<cchunk; ++ichunk)
+      if (m_levelPending[ichunk] == level+1)
+	(void)requestChunk(pool, level, ichunk, WorkerPool::priorityLow);
+  // Each chunk is uploaded as soon as it's built, during later calls to pool.runMain() or pool.wait().
+}
+
+// Called by worker threads.
+void Feature::makeTextureMipmapChunk(QueueElement& e) const {
+  const int mipmaplevel = e.mipmaplevel;
+  const int width = e.width;
+  const int ichunk = e.ichunk;
+  unsigned char*& bufByte = e.bufByte;
+  bool& fBC4 = e.fBC4;
+  if (m_mip) {
+    // Copying from the mmap makes this thread, not the main thread, wait for the disk.
+    const MipmapHeader& h = *(const MipmapHeader*)m_mip->pch();
+    const int levelMip = mipmaplevel + m_mipLevelSkip;
+    const unsigned char* pb = (const unsigned char*)m_mip->pch() + sizeof(MipmapHeader) + h.offset(levelMip, ichunk);
+    fBC4 = h.format == MipmapHeader::formatBC4 && m_fCompressed;
+    if (h.format == MipmapHeader::formatBC4 && !m_fCompressed) {
+      bufByte = new unsigned char[vectorsize()*width];
+      bc4Decode(pb, width, vectorsize(), bufByte);
+    } else {
+      // If h.format is formatBytes but m_fCompressed, the driver compresses it.
+      const long cb = h.chunkBytes(levelMip);
+      bufByte = new unsigned char[cb];
+      memcpy(bufByte, pb, cb);
     }
+  } else {
+    bufByte = new unsigned char[vectorsize()*width];
+    const double chunkL = ichunk     / double(cchunk); // e.g., 5/8
+    const double chunkR = (ichunk+1) / double(cchunk); // e.g., 6/8
+    m_cacheHTK->getbatchByte(bufByte,
+	lerp(chunkL, tShowBound[0], tShowBound[1]),
+	lerp(chunkR, tShowBound[0], tShowBound[1]),
+	vectorsize(), width, m_iColormap);
   }
 }
 
-extern double tShowBound[2];
+// Build a chunk's level on a worker thread.
+class BuildChunk : public Task {
+  const std::shared_ptr<QueueElement> _e;
+public:
+  BuildChunk(const std::shared_ptr<QueueElement>& e) : _e(e) {}
+  void work() const {
+    if (!WorkerPool::stopRequested())
+      _e->feature->makeTextureMipmapChunk(*_e);
+  }
+};
 
-const void Feature::makeTextureMipmapChunk(const CHello& cacheHTK, const int mipmaplevel, const int width, const int ichunk) const {
-  unsigned char* bufByte = new unsigned char[vectorsize()*width];
-  const double chunkL = ichunk     / double(cchunk); // e.g., 5/8
-  const double chunkR = (ichunk+1) / double(cchunk); // e.g., 6/8
+// Multithreaded OpenGL is tricky, brittle, poorly documented.
+// So upload it not from the worker pool but only afterwards, from the main thread.
+class UploadChunk : public Task {
+  const std::shared_ptr<QueueElement> _e;
+  WorkerPool& _pool;
+  const long _cb;
+public:
+  UploadChunk(const std::shared_ptr<QueueElement>& e, WorkerPool& pool, long cb) : _e(e), _pool(pool), _cb(cb) {}
+  void work() const {
+    _e->feature->finishMipmap(*_e);
+    _pool.release(_cb);
+  }
+  bool fReady() const { return _e->feature->fRoomFor(_e->mipmaplevel); }
+  void abandon() const {
+    _e->feature->abandonMipmap(*_e);
+    _pool.release(_cb);
+  }
+};
 
-  printf("makeTextureMipmapChunk 0, vectorsize %d\n", vectorsize());
-  cacheHTK.getbatchByte(bufByte,
-      lerp(chunkL, tShowBound[0], tShowBound[1]),
-      lerp(chunkR, tShowBound[0], tShowBound[1]),
-      vectorsize(), width, m_iColormap);
+// Build and then upload a chunk's next finer level.
+// Upload it only after its next coarser level, so GL_TEXTURE_BASE_LEVEL can expose it.
+// Give up if the pool is already holding too much RAM.
+bool Feature::requestChunk(WorkerPool& pool, const int mipmaplevel, const int ichunk, const int priority) {
+  assert(mipmaplevel == m_levelPending[ichunk] - 1);
+  // Unless load() couldn't start it, or cancelStale() stopped it.
+  if (!m_mip && (!m_hCache || m_hCache->cancelled()) && !buildCache(pool))
+    return false;
+  const int width = m_widthChunk >> mipmaplevel;
+  const long cb = long(width) * vectorsize(); // bufByte
+  if (!pool.tryAdmit(cb))
+    return false;
+  const std::shared_ptr<QueueElement> e(new QueueElement(this, ichunk, width, mipmaplevel));
+  const TaskHandle build = pool.task(new BuildChunk(e), TaskHandles(1, m_hCache), priority, m_home);
+  m_builds[ichunk].push_back(build);
+  TaskHandles deps;
+  deps.push_back(build);
+  if (m_levelPending[ichunk] < levelBase[ichunk])
+    deps.push_back(m_uploadLast[ichunk]); // Else it's done, or abandoned.
+  m_uploadLast[ichunk] = pool.taskMain(new UploadChunk(e, pool, cb), deps, priority);
+  m_levelPending[ichunk] = mipmaplevel;
+  return true;
+}
 
-  arGuard _(lockQueue);
-  queueChunk.push_back( QueueElement(bufByte, ichunk, width, mipmaplevel) );
+// Eager levels always fit.  Finer ones wait for evict() to make room.
+bool Feature::fRoomFor(const int mipmaplevel) const {
+  return mipmaplevel >= m_levelEager || !gpuBudget.over(levelBytes(mipmaplevel));
+}
+
+// Ask the pool for the levels of the chunks needed to draw [t0, t1] across that many pixels.
+// Coarser levels first, because a level can be drawn only after all coarser ones are uploaded.
+void Feature::prefetch(WorkerPool& pool, const double t0, const double t1, const double pixels, const int priority) {
+  if (t1 <= t0)
+    return;
+  const double dtChunk = (tShowBound[1] - tShowBound[0]) / cchunk;
+  const int level = levelFromPixels(pixels * dtChunk / (t1-t0));
+  const int i0 = std::max(0,        int(floor((t0 - tShowBound[0]) / dtChunk)));
+  const int i1 = std::min(cchunk-1, int(floor((t1 - tShowBound[0]) / dtChunk)));
+  for (int ichunk=i0; ichunk<=i1; ++ichunk)
+    m_frameWanted[ichunk] = frame;
+  // Don't pile up so many requests that the worker pool lags behind the view.
+  // Onscreen ones go ahead of the backlog anyways.
+  const size_t backlogMax = 64;
+  for (int l=levels-1; l>=level; --l) {
+    for (int ichunk=i0; ichunk<=i1; ++ichunk) {
+      if (m_levelPending[ichunk] == l+1 && (priority == WorkerPool::priorityHigh || pool.backlog() < backlogMax))
+	(void)requestChunk(pool, l, ichunk, priority);
+    }
+  }
+}
+
+// Cancel requests for chunks that prefetch() hasn't wanted for a while, e.g. after a pan or zoom.
+// A little while, so a jittery prediction doesn't keep cancelling and re-requesting the same chunk.
+void Feature::cancelStale(WorkerPool& pool) {
+  const unsigned framesStale = 30;
+  // Stop building the cache too, if no chunk is wanted.
+  bool fWanted = false;
+  for (int ichunk=0; ichunk<cchunk; ++ichunk)
+    fWanted |= frame - m_frameWanted[ichunk] <= framesStale;
+  if (!fWanted && m_hCache && !m_hCache->done())
+    pool.cancel(m_hCache);
+  for (int ichunk=0; ichunk<cchunk; ++ichunk) {
+    TaskHandles& builds = m_builds[ichunk];
+    if (builds.empty())
+      continue;
+    if (m_levelPending[ichunk] == levelBase[ichunk]) {
+      builds.clear(); // All uploaded.
+      continue;
+    }
+    if (frame - m_frameWanted[ichunk] <= framesStale)
+      continue;
+    for (TaskHandles::const_iterator it = builds.begin(); it != builds.end(); ++it)
+      pool.cancel(*it);
+    builds.clear();
+  }
 }
 
 #include <GL/glx.h>
 #include <X11/Xlib.h>
 
-// Multithreaded OpenGL is tricky, brittle, poorly documented.
-// So we call OpenGL not from the worker pool but only afterwards.
+// Called by the main thread, instead of finishMipmap, if the request was cancelled.
+// Coarser levels' requests, if also cancelled, are abandoned first.
+void Feature::abandonMipmap(const QueueElement& arg) {
+  delete [] arg.bufByte;
+  m_levelPending[arg.ichunk] = std::max(m_levelPending[arg.ichunk], arg.mipmaplevel+1);
+}
+
+// Called by the main thread, after the chunk's next coarser level.
 void Feature::finishMipmap(const QueueElement& arg) {
+  assert(arg.mipmaplevel == levelBase[arg.ichunk] - 1);
+  if (arg.fBC4)
+    uploadMipmapBC4(arg.ichunk, arg.mipmaplevel, arg.width, arg.bufByte);
+  else
+    uploadMipmap(arg.ichunk, arg.mipmaplevel, arg.width, arg.bufByte);
+  delete [] arg.bufByte;
+  gpuBudget.alloc(levelBytes(arg.mipmaplevel));
+  levelBase[arg.ichunk] = arg.mipmaplevel;
+  if (!m_fCompressed) {
+    // Sample only the uploaded levels.
+    for (int j=0; j<vectorsize(); ++j) {
+      glBindTexture(GL_TEXTURE_1D, rgTex[arg.ichunk].tex[j]);
+      glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_BASE_LEVEL, arg.mipmaplevel);
+    }
+  }
+}
+
+// Upload one level of one chunk, vectorsize() rows of width bytes.
+void Feature::uploadMipmap(const int ichunk, const int mipmaplevel, const int width, const unsigned char* bufByte) const {
+  if (m_fCompressed) {
+    glBindTexture(GL_TEXTURE_2D, rgTex[ichunk].texLevel[mipmaplevel]);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_COMPRESSED_RED_RGTC1, width, vectorsize(), 0, GL_RED, GL_UNSIGNED_BYTE, bufByte);
+    return;
+  }
   for (int j=0; j<vectorsize(); ++j) {
-    printf("finishMipmap\n");
-    //;;;;FAILS assert(glIsTexture(rgTex[arg.ichunk].tex[j]) == GL_TRUE);
-    glBindTexture(GL_TEXTURE_1D, rgTex[arg.ichunk].tex[j]);
-    glTexImage1D(GL_TEXTURE_1D, arg.mipmaplevel, GL_INTENSITY8, arg.width, 0, GL_RED, GL_UNSIGNED_BYTE, arg.bufByte + arg.width*j);
+    assert(glIsTexture(rgTex[ichunk].tex[j]) == GL_TRUE);
+    glBindTexture(GL_TEXTURE_1D, rgTex[ichunk].tex[j]);
+    glTexImage1D(GL_TEXTURE_1D, mipmaplevel, GL_INTENSITY8, width, 0, GL_RED, GL_UNSIGNED_BYTE, bufByte + width*j);
   }
-  //;;;;?last one FAILS    delete [] arg.bufByte;
 }
 
-extern WorkerPool* pool;
-const void Feature::makeTextureMipmap(const CHello& cacheHTK, const int mipmaplevel, int width) const {
-  assert(vectorsize() <= vecLim);
-  assert(width % cchunk == 0);
-  width /= cchunk;
+// Graphics RAM used by one level of one chunk.
+long Feature::levelBytes(const int mipmaplevel) const {
+  const int width = m_widthChunk >> mipmaplevel;
+  return m_fCompressed ? bc4Bytes(width, vectorsize()) : long(width) * vectorsize();
+}
 
-  //if (mipmaplevel<3) printf("    Computing %d mipmaps of width %d.\n", cchunk, width);
-  //printf("vectorsize %d\n", vectorsize());
-#if 1
+// The least recently wanted chunk whose finest level can be evicted, if wanted before frameOldest.
+// Else -1.
+int Feature::chunkToEvict(unsigned& frameOldest) const {
+  int ichunkOldest = -1;
   for (int ichunk=0; ichunk<cchunk; ++ichunk) {
-    pool->task(new WorkerArgs(*this, cacheHTK, mipmaplevel, width, ichunk));
+    if (levelBase[ichunk] >= m_levelEager || m_levelPending[ichunk] != levelBase[ichunk])
+      continue; // Only eager levels, or a finer level is on its way.
+    if (m_frameWanted[ichunk] < frameOldest) {
+      frameOldest = m_frameWanted[ichunk];
+      ichunkOldest = ichunk;
+    }
   }
-#else
-  unsigned char* bufByte = new unsigned char[vectorsize()*width];
-  for (int ichunk=0; ichunk<cchunk; ++ichunk) {
-    const double chunkL = ichunk     / double(cchunk); // e.g., 5/8
-    const double chunkR = (ichunk+1) / double(cchunk); // e.g., 6/8
-  printf("makeTextureMipmapChunk 0, vectorsize %d\n", vectorsize());
-    cacheHTK.getbatchByte(bufByte,
-	lerp(chunkL, tShowBound[0], tShowBound[1]),
-	lerp(chunkR, tShowBound[0], tShowBound[1]),
-	vectorsize(), width, m_iColormap);
+  return ichunkOldest;
+}
+
+// Free the finest level of a chunk.
+void Feature::evict(const int ichunk) {
+  const int level = levelBase[ichunk];
+  assert(level < m_levelEager && m_levelPending[ichunk] == level);
+  if (m_fCompressed) {
+    GLuint& t = rgTex[ichunk].texLevel[level];
+    glDeleteTextures(1, &t);
+    glGenTextures(1, &t);
+    prepTextureLevel(t);
+  } else {
     for (int j=0; j<vectorsize(); ++j) {
-      assert(glIsTexture(rgTex[ichunk].tex[j]) == GL_TRUE);
       glBindTexture(GL_TEXTURE_1D, rgTex[ichunk].tex[j]);
-      glTexImage1D(GL_TEXTURE_1D, mipmaplevel, GL_INTENSITY8, width, 0, GL_RED, GL_UNSIGNED_BYTE, bufByte + width*j);
+      glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_BASE_LEVEL, level+1);
+      glTexImage1D(GL_TEXTURE_1D, level, GL_INTENSITY8, 0, 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
     }
   }
-  delete [] bufByte;
-#endif
+  gpuBudget.free(levelBytes(level));
+  levelBase[ichunk] = m_levelPending[ichunk] = level+1;
+}
+
+// Like uploadMipmap, but already compressed by bc4Encode.
+void Feature::uploadMipmapBC4(const int ichunk, const int mipmaplevel, const int width, const unsigned char* bufBC4) const {
+  assert(m_fCompressed);
+  glBindTexture(GL_TEXTURE_2D, rgTex[ichunk].texLevel[mipmaplevel]);
+  glCompressedTexImage2D(GL_TEXTURE_2D, 0, GL_COMPRESSED_RED_RGTC1, width, vectorsize(), 0, bc4Bytes(width, vectorsize()), bufBC4);
+}
+
+// Finest level needed to draw a chunk that spans that many pixels.
+// If compressed, like GL_LINEAR_MIPMAP_NEAREST, nearest to one texel per pixel.
+// Otherwise, the finer of the two that GL_LINEAR_MIPMAP_LINEAR blends.
+int Feature::levelFromPixels(const double pixelsPerChunk) const {
+  const double texelsPerPixel = (1 << (levels-1)) / std::max(pixelsPerChunk, 1.0);
+  const int level = int(floor(log2(texelsPerPixel) + (m_fCompressed ? 0.5 : 0.0)));
+  return std::max(0, std::min(level, levels-1));
 }
@@ -1,57 +1,104 @@
 #pragma once
 #include "timeliner_cache.h"
+#include "timeliner_util_threads.h" // TaskHandle
 #include <string>
 
 #include <GL/glew.h> // before gl.h
 #include <GL/glut.h> // only for GLuint
 
+class Mmap; // timeliner_util.h
+
+class Feature;
+
+// One level of one chunk, made by a worker thread, awaiting upload by the main thread.
 class QueueElement {
 public:
+  Feature* feature;
   unsigned char* bufByte;
   int ichunk;
   int width;
   int mipmaplevel;
-  QueueElement( unsigned char* a, int b, int c, int d) :
-    bufByte(a), ichunk(b), width(c), mipmaplevel(d) {}
+  bool fBC4; // bufByte is compressed, for uploadMipmapBC4
+  QueueElement( Feature* f, int b, int c, int d) :
+    feature(f), bufByte(NULL), ichunk(b), width(c), mipmaplevel(d), fBC4(false) {}
 };
 
 class Feature {
 
   enum { vecLim = CQuartet_widthMax+1 }; // from timeliner_cache.h
-  static int mb;
-  enum { mbUnknown, mbZero, mbPositive };
+  enum { levelLim = 16 }; // GL_MAX_TEXTURE_SIZE is far less than 2^levelLim.
 
   class Slartibartfast {
   public:
-    GLuint tex[vecLim];
+    GLuint tex[vecLim];		// One mipmapped 1D texture per row.
+    GLuint texLevel[levelLim];	// Or, if compressed(), one 2D texture of all rows per mipmap level.
   };
 
 public:
   int cchunk;
+  int levels;
   std::vector<Slartibartfast> rgTex;
+  // Levels levelBase[ichunk] .. levels-1 of each chunk are uploaded.
+  // Finer ones are made only when prefetch() predicts that they'll be drawn,
+  // and evicted when gpuBudget runs out.
+  std::vector<int> levelBase;
+  static unsigned frame; // Incremented by the app, for evicting least recently wanted chunks.
 
   Feature(int /*iColormap*/, const std::string& filename, const std::string& dirname);
+  ~Feature();
+  void load(WorkerPool&); // Once it's about to be drawn.  From prefetch(), not while drawing.
 
-  void makeMipmaps();
-  const void makeTextureMipmap     (const CHello& cacheHTK, int mipmaplevel, int width)             const;
-  const void makeTextureMipmapChunk(const CHello& cacheHTK, int mipmaplevel, int width, int ichunk) const;
+  void makeMipmaps(const std::string& mipfile, WorkerPool&);
+  int mipmapLevelSkip(const Mmap& mip, const std::string& mipfile, unsigned width, int widthLim) const;
+  void makeTextureMipmapChunk(QueueElement&) const;
+  void makeCache(unsigned subsample);
+  bool buildCache(WorkerPool&);
+  bool requestChunk(WorkerPool&, int mipmaplevel, int ichunk, int priority);
+  void prefetch(WorkerPool&, double t0, double t1, double pixels, int priority);
+  void cancelStale(WorkerPool&);
   void finishMipmap(const QueueElement&);
+  void abandonMipmap(const QueueElement&);
+  bool fRoomFor(int mipmaplevel) const;
+  int chunkToEvict(unsigned& frameOldest) const;
+  void evict(int ichunk);
+  long levelBytes(int mipmaplevel) const;
+  void uploadMipmap(int ichunk, int mipmaplevel, int width, const unsigned char* bufByte) const;
+  void uploadMipmapBC4(int ichunk, int mipmaplevel, int width, const unsigned char* bufBC4) const;
+  int levelFromPixels(double pixelsPerChunk) const;
 
-  bool hasGraphicsRAM() const { return mb == mbPositive; }
+  bool compressed() const { return m_fCompressed; }
 
   void binaryload(const char* pch, long cch);
 
   bool fValid()      const { return m_fValid; }
+  bool loaded()      const { return m_fLoaded; }
+  bool drawable(int ichunk) const { return levelBase[ichunk] < levels; } // Some level is uploaded.
   int vectorsize()   const { return m_vectorsize; }
   int samples()      const { return m_cz / m_vectorsize; }
-  const char* name() const { return m_name; }
+  const char* name() const { return m_name.c_str(); }
 
 private:
   bool m_fValid;
+  bool m_fLoaded;	// load() has started building the textures.
+  bool m_fCompressed;	// RGTC1 2D textures, not GL_INTENSITY8 1D textures
+  int m_widthChunk;	// texels per chunk, at level 0
+  int m_levelEager;	// Coarser levels are never evicted.
+  std::vector<int> m_levelPending; // finest level requested from the WorkerPool, per chunk
+  TaskHandles m_uploadLast; // per chunk, the upload of m_levelPending
+  std::vector<TaskHandles> m_builds; // per chunk, builds of levels not yet uploaded, for cancelStale()
+  std::vector<unsigned> m_frameWanted; // when prefetch() last wanted each chunk
+  const std::string m_mipfile;
+  const Mmap* m_marshaled; // Source of m_pz.
+  const Mmap* m_mip;	// Source of chunks, if timeliner_pre precomputed them.
+  int m_mipLevelSkip;	// m_mip's level that is level 0 here.
+  const CHello* m_cacheHTK; // Otherwise, source of chunks.
+  TaskHandle m_hCache;	// Builds m_cacheHTK.
+  unsigned m_subsample;	// of m_cacheHTK
+  int m_home;		// Worker that builds m_cacheHTK, or -1.
   int m_iColormap;
-  float m_period;	// seconds per sample
+  double m_period;	// seconds per sample
   int m_vectorsize;	// e.g., how many frequency bins in a spectrogram
   const float* m_pz;	// m_pz[0..m_cz] is the (vectors of) raw data
   long m_cz;
-  char m_name[1000];
+  std::string m_name;
 };
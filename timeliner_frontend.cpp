@@ -0,0 +1,240 @@
+#include "timeliner_frontend.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#ifndef M_PI
+#define M_PI (3.1415926535898)
+#endif
+
+PowerSpectrum::PowerSpectrum(const int n) :
+  _n(n),
+  _re(n/2), _im(n/2), _reTmp(n/2), _imTmp(n/2),
+  _cosSplit(n/2+1), _sinSplit(n/2+1)
+{
+  assert(n >= 4 && (n & (n-1)) == 0);
+  for (int len=n/2; len>1; len/=2) {
+    for (int p=0; p<len/2; ++p) {
+      _cosHalf.push_back(float(cos(2.0*M_PI*p / len)));
+      _sinHalf.push_back(float(sin(2.0*M_PI*p / len)));
+    }
+  }
+  for (int k=0; k<=n/2; ++k) {
+    _cosSplit[k] = float(cos(2.0*M_PI*k / n));
+    _sinSplit[k] = float(sin(2.0*M_PI*k / n));
+  }
+}
+
+// In-place complex FFT of _re and _im, of length _n/2.
+const float* PowerSpectrum::fftHalf()
+{
+  const int m = _n/2;
+  float* xr = &_re[0];
+  float* xi = &_im[0];
+  float* yr = &_reTmp[0];
+  float* yi = &_imTmp[0];
+  const float* wc = &_cosHalf[0];
+  const float* ws = &_sinHalf[0];
+  // Each stage splits len-point transforms, s of them interleaved, into pairs of half-length ones.
+  for (int len=m, s=1; len>1; len/=2, s*=2) {
+    const int h = len/2;
+    for (int p=0; p<h; ++p) {
+      const float c = wc[p];
+      const float sn = ws[p]; // w = c - i*sn
+      const float* __restrict ar = xr + s*p;
+      const float* __restrict ai = xi + s*p;
+      const float* __restrict br = xr + s*(p+h);
+      const float* __restrict bi = xi + s*(p+h);
+      float* __restrict sr = yr + s*2*p;
+      float* __restrict si = yi + s*2*p;
+      float* __restrict dr = yr + s*(2*p+1);
+      float* __restrict di = yi + s*(2*p+1);
+      for (int q=0; q<s; ++q) {
+	sr[q] = ar[q] + br[q];
+	si[q] = ai[q] + bi[q];
+	const float er = ar[q] - br[q];
+	const float ei = ai[q] - bi[q];
+	dr[q] = er*c + ei*sn;
+	di[q] = ei*c - er*sn;
+      }
+    }
+    wc += h;
+    ws += h;
+    std::swap(xr, yr);
+    std::swap(xi, yi);
+  }
+  return xr;
+}
+
+void PowerSpectrum::operator()(const float* x, float* power)
+{
+  // Pack even samples as real parts, odd as imaginary.
+  const int m = _n/2;
+  for (int k=0; k<m; ++k) {
+    _re[k] = x[2*k];
+    _im[k] = x[2*k+1];
+  }
+  const float* zr = fftHalf();
+  const float* zi = zr == &_re[0] ? &_im[0] : &_imTmp[0];
+
+  // X[k] = E[k] + w^k O[k], where E and O are the spectra of the even and odd samples.
+  for (int k=0; k<=m; ++k) {
+    const int j = k % m;
+    const int jc = (m - k) % m;
+    const float er = 0.5f * (zr[j] + zr[jc]);
+    const float ei = 0.5f * (zi[j] - zi[jc]);
+    const float orr = 0.5f * (zi[j] + zi[jc]);
+    const float oi = -0.5f * (zr[j] - zr[jc]);
+    const float c = _cosSplit[k];
+    const float s = _sinSplit[k];
+    const float xr = er + c*orr + s*oi;
+    const float xi = ei + c*oi - s*orr;
+    power[k] = xr*xr + xi*xi;
+  }
+}
+
+static inline double mel(const double hz) { return 1127.0 * log(1.0 + hz/700.0); }
+
+static int fftSize(const int c)
+{
+  int n = 4;
+  while (n < c)
+    n *= 2;
+  return n;
+}
+
+Frontend::Frontend(const Kind kind, const double sr, const int numchans) :
+  _kind(kind),
+  _numchans(numchans),
+  _vectorsize(kind == kindFbankDeltas ? 3*numchans : numchans),
+  _period(0.01),
+  _cSampShift(sr * _period),
+  _cSampWindow(int(sr * 8 * _period)),
+  _cFft(fftSize(_cSampWindow)),
+  _hamming(_cSampWindow),
+  _chanLo(_cFft/2 + 1, -1),
+  _weightLo(_cFft/2 + 1, 0.0f),
+  _x(_cFft, 0.0f),
+  _power(_cFft/2 + 1),
+  _fbank(numchans),
+  _spectrum(_cFft)
+{
+  for (int i=0; i<_cSampWindow; ++i)
+    _hamming[i] = float(0.54 - 0.46 * cos(2.0*M_PI*i / (_cSampWindow-1.0)));
+
+  // Triangular filters, evenly spaced in mel from LOFREQ 0 to HIFREQ sr/2,
+  // each spanning from its lower neighbor's center to its upper neighbor's.
+  // Like HTK, skip DC and the Nyquist bin.
+  const double hzPerBin = double(sr) / _cFft;
+  const double melLo = 0.0;
+  const double melHi = mel(sr / 2.0);
+  std::vector<double> center(numchans + 2);
+  for (int c=0; c<=numchans+1; ++c)
+    center[c] = melLo + (melHi - melLo) * c / (numchans + 1.0);
+  _binLo = 1;
+  _binHi = _cFft/2 - 1;
+  int chan = 1;
+  for (int k=_binLo; k<=_binHi; ++k) {
+    const double melk = mel(k * hzPerBin);
+    while (chan <= numchans && center[chan] < melk)
+      ++chan;
+    _chanLo[k] = chan - 1;
+    _weightLo[k] = float((center[chan] - melk) / (center[chan] - center[chan-1]));
+  }
+
+  if (_kind == kindMfcc) {
+    // DCT-II of the log filterbank, cepstra 1 to numchans (not 0), liftered with CEPLIFTER 22.
+    const double lifter = 22.0;
+    const double norm = sqrt(2.0 / numchans);
+    _dct.resize(numchans * numchans);
+    for (int j=0; j<numchans; ++j) {
+      const double lift = 1.0 + lifter/2.0 * sin(M_PI * (j+1) / lifter);
+      for (int k=0; k<numchans; ++k)
+	_dct[j*numchans + k] = float(lift * norm * cos(M_PI * (j+1) / numchans * (k + 0.5)));
+    }
+  }
+}
+
+long Frontend::frames(const long csamp) const
+{
+  return csamp < _cSampWindow ? 0 : long(floor((csamp - _cSampWindow) / _cSampShift)) + 1;
+}
+
+long Frontend::frameStart(const long iFrame) const
+{
+  return long(iFrame * _cSampShift);
+}
+
+void Frontend::frame(const short* src, float* dst)
+{
+  const int w = _cSampWindow;
+  // ZMEANSOURCE.
+  float mean = 0.0f;
+  for (int i=0; i<w; ++i)
+    mean += src[i];
+  mean /= w;
+  for (int i=0; i<w; ++i)
+    _x[i] = src[i] - mean;
+  // PREEMCOEF, from the end backwards, so it's in place.
+  const float preem = 0.97f;
+  for (int i=w-1; i>0; --i)
+    _x[i] -= preem * _x[i-1];
+  _x[0] *= 1.0f - preem;
+  // USEHAMMING.  Zero-padded up to _cFft.
+  for (int i=0; i<w; ++i)
+    _x[i] *= _hamming[i];
+
+  _spectrum(&_x[0], &_power[0]);
+
+  std::fill(_fbank.begin(), _fbank.end(), 0.0f);
+  for (int k=_binLo; k<=_binHi; ++k) {
+    const int c = _chanLo[k];
+    const float lo = _weightLo[k] * _power[k];
+    if (c > 0)
+      _fbank[c-1] += lo;
+    if (c < _numchans)
+      _fbank[c] += _power[k] - lo;
+  }
+  // Log, floored at 1 like HTK's.
+  for (int c=0; c<_numchans; ++c)
+    _fbank[c] = logf(std::max(1.0f, _fbank[c]));
+
+  if (_kind != kindMfcc) {
+    std::copy(_fbank.begin(), _fbank.end(), dst);
+    return;
+  }
+  for (int j=0; j<_numchans; ++j) {
+    const float* row = &_dct[j*_numchans];
+    float z = 0.0f;
+    for (int k=0; k<_numchans; ++k)
+      z += row[k] * _fbank[k];
+    dst[j] = z;
+  }
+}
+
+// Regression over DELTAWINDOW 2 frames each way, repeating the first and last frames past the ends.
+// Deltas of the statics, then deltas of those (accelerations).
+void Frontend::deltas(float* data, const long cFrame) const
+{
+  if (_kind != kindFbankDeltas)
+    return;
+  const int window = deltaWindow;
+  const float norm = 1.0f / (2.0f * (1*1 + 2*2));
+  for (int pass=1; pass<=2; ++pass) {
+    const int from = (pass-1) * _numchans;
+    const int to = pass * _numchans;
+    for (long t=0; t<cFrame; ++t) {
+      float* dst = data + t*_vectorsize + to;
+      std::fill(dst, dst + _numchans, 0.0f);
+      for (int th=1; th<=window; ++th) {
+	const float* next = data + std::min(t+th, cFrame-1)*_vectorsize + from;
+	const float* prev = data + std::max(t-th, 0L)*_vectorsize + from;
+	for (int c=0; c<_numchans; ++c)
+	  dst[c] += th * (next[c] - prev[c]);
+      }
+      for (int c=0; c<_numchans; ++c)
+	dst[c] *= norm;
+    }
+  }
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <vector>
+
+// Speech front end, computing what HTK's HCopy did with the configuration that timeliner_pre used to hand it:
+// USEHAMMING, ZMEANSOURCE, USEPOWER, PREEMCOEF 0.97, LOFREQ 0, HIFREQ SR/2,
+// an 80 ms window every 10 ms, numchans mel filters, and NUMCEPS numchans.
+//
+// One frame at a time, so the caller decides where samples come from and where vectors go.
+// Deltas need neighboring frames, so they're a separate pass over a block of finished vectors.
+// The _Z qualifier (subtract each static coefficient's mean over the whole recording) is left to the caller.
+
+// Power spectrum of real input, via a half-length complex FFT.
+// Radix-2 Stockham, on separate arrays of real and imaginary parts,
+// so the butterflies' inner loops are unit-stride and the compiler vectorizes them.
+class PowerSpectrum {
+public:
+  PowerSpectrum(int n);				// n a power of two, at least 4
+  void operator()(const float* x, float* power);	// x[0..n), power[0..n/2]
+private:
+  const int _n;
+  std::vector<float> _re, _im, _reTmp, _imTmp;
+  std::vector<float> _cosHalf, _sinHalf;	// each stage's twiddles, for the half-length FFT
+  std::vector<float> _cosSplit, _sinSplit;	// twiddles that split that into the real input's spectrum
+  const float* fftHalf();			// Returns where the result landed, _re or _reTmp.
+};
+
+class Frontend {
+public:
+  enum Kind { kindFbank, kindMfcc, kindFbankDeltas };	// FBANK_Z, MFCC_Z, FBANK_D_A_Z
+  Frontend(Kind kind, double sr, int numchans);
+
+  int vectorsize() const { return _vectorsize; }
+  double period() const { return _period; }	// seconds between frames
+  int frameLength() const { return _cSampWindow; }
+  int statics() const { return _numchans; }	// Coefficients before the deltas, if any.
+  long deltaMargin() const { return _kind == kindFbankDeltas ? 2*deltaWindow : 0; } // Frames on either side that deltas() reads.
+  long frames(long csamp) const;		// How many frames that many samples make.
+  long frameStart(long iFrame) const;		// First sample of a frame.
+
+  // The static coefficients, i.e. the first numchans of vectorsize(), of the frame starting at src.
+  // Uses scratch buffers, so each thread needs its own Frontend.
+  void frame(const short* src, float* dst);
+
+  // After frame() has filled cFrame consecutive vectors.
+  // Only the ones at least deltaMargin() from either end are exact, unless that end is the recording's.
+  void deltas(float* data, long cFrame) const;
+
+private:
+  enum { deltaWindow = 2 };
+  const Kind _kind;
+  const int _numchans;
+  const int _vectorsize;
+  const double _period;
+  const double _cSampShift;	// Not rounded, so frames stay exactly _period apart.
+  const int _cSampWindow;
+  const int _cFft;
+  std::vector<float> _hamming;
+  std::vector<int> _chanLo;	// Per FFT bin from _binLo to _binHi, how many mel filters' centers are below it.
+  std::vector<float> _weightLo;	// Per FFT bin, its weight in the highest of those filters.
+  int _binLo, _binHi;
+  std::vector<float> _dct;	// numchans by numchans, including the cepstral lifter
+  std::vector<float> _x, _power, _fbank;
+  PowerSpectrum _spectrum;
+};
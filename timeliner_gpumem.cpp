@@ -0,0 +1,78 @@
+#include "timeliner_gpumem.h"
+#include "timeliner_diagnostics.h"
+
+#include <GL/glew.h> // before gl.h
+#include <GL/glut.h>
+#ifndef _MSC_VER
+#include <GL/glx.h>
+#endif
+#include <cstdio>
+#include <cstdlib>
+
+GpuBudget gpuBudget;
+
+// Graphics RAM that the driver says is free, or that it has at all.  0 if unknown.
+float gpuMBavailable(bool& fTotal)
+{
+  fTotal = false;
+  // glerror GL_OUT_OF_MEMORY ?
+  // kernel: [4391985.748987] NVRM: VM: nv_vm_malloc_pages: failed to allocate contiguous memory
+
+  // http://developer.download.nvidia.com/opengl/specs/GL_NVX_gpu_memory_info.txt
+  if (GLEW_NVX_gpu_memory_info) {
+    #define GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX 0x9049
+    GLint cur_avail_mem_kb = 0;
+    glGetIntegerv(GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX, &cur_avail_mem_kb);
+    if (cur_avail_mem_kb > 0)
+      return cur_avail_mem_kb/1000.0F;
+  }
+
+  // www.opengl.org/registry/specs/ATI/meminfo.txt
+  if (GLEW_ATI_meminfo) {
+    #define TEXTURE_FREE_MEMORY_ATI 0x87FC
+    GLint kb[4] = {0}; // total free, largest block, total aux free, largest aux block
+    glGetIntegerv(TEXTURE_FREE_MEMORY_ATI, kb);
+    if (kb[0] > 0)
+      return kb[0]/1000.0F;
+  }
+
+#ifndef _MSC_VER
+  // Mesa, including llvmpipe, reports only the total, not what's free.
+  // www.opengl.org/registry/specs/MESA/glx_query_renderer.txt
+  typedef Bool (*PFNQUERY)(int attribute, unsigned int* value);
+  const PFNQUERY query = (PFNQUERY)glXGetProcAddressARB((const GLubyte*)"glXQueryCurrentRendererIntegerMESA");
+  if (query) {
+    #define RENDERER_VIDEO_MEMORY_MESA 0x8187
+    unsigned int mb = 0;
+    if (query(RENDERER_VIDEO_MEMORY_MESA, &mb) && mb > 0) {
+      fTotal = true;
+      return float(mb);
+    }
+  }
+#endif
+  return 0.0f;
+}
+
+void GpuBudget::init()
+{
+  const char* pch = getenv("timeliner_gpumb");
+  float mb = pch ? float(atof(pch)) : 0.0f;
+  if (mb > 0.0f) {
+    printf("Using %.0f graphics MB from environment variable timeliner_gpumb.\n", mb);
+  } else {
+    bool fTotal;
+    mb = gpuMBavailable(fTotal);
+    if (mb <= 0.0f) {
+      mb = 256.0f;
+      warn("Found no report of graphics RAM.  Try export timeliner_gpumb=500.");
+    } else {
+      // Less than 50 MB free may hang X.  Mouse responsive, Xorg 100% cpu, network up, console frozen.
+      // Share a total with X and other apps.
+      mb = fTotal ? mb/2.0f : mb - 50.0f;
+      if (mb < 32.0f)
+        mb = 32.0f;
+    }
+    printf("Using %.0f graphics MB.\n", mb);
+  }
+  _cbBudget = long(mb * 1e6);
+}
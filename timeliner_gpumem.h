@@ -0,0 +1,28 @@
+#pragma once
+
+// Accounting of the GPU memory this app uses for textures and buffers.
+//
+// Drivers don't portably report their own usage:  GL_NVX_gpu_memory_info is NVIDIA-only,
+// and llvmpipe has no dedicated graphics RAM at all.
+// So count bytes as they're allocated, against a budget from the environment variable timeliner_gpumb,
+// or else from whatever the driver reports at startup.
+
+class GpuBudget {
+public:
+  GpuBudget() : _cbBudget(0), _cbUsed(0) {}
+  void init(); // After glewInit.
+
+  void alloc(long cb) { _cbUsed += cb; }
+  void free (long cb) { _cbUsed -= cb; }
+
+  long budget() const { return _cbBudget; }
+  long used()   const { return _cbUsed; }
+  long room()   const { return _cbBudget - _cbUsed; }
+  bool over(long cbMore = 0) const { return _cbUsed + cbMore > _cbBudget; }
+
+private:
+  long _cbBudget;
+  long _cbUsed;
+};
+
+extern GpuBudget gpuBudget; // Only the main thread, which owns the GL context, may use this.
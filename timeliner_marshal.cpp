@@ -0,0 +1,36 @@
+#include "timeliner_marshal.h"
+#include "timeliner_diagnostics.h"
+
+#include <fstream>
+#include <sstream>
+
+static std::string manifestFile(const std::string& dirname) { return dirname + "/manifest"; }
+
+bool writeManifest(const std::string& dirname, const std::vector<MarshalEntry>& entries)
+{
+  std::ofstream t(manifestFile(dirname).c_str());
+  t << "# marshal file, channel, colormap, caption\n";
+  for (std::vector<MarshalEntry>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+    t << it->filename << " " << it->channel << " " << it->iColormap << " " << it->caption << "\n";
+  t.flush();
+  return t.good();
+}
+
+std::vector<MarshalEntry> readManifest(const std::string& dirname)
+{
+  std::vector<MarshalEntry> entries;
+  std::ifstream t(manifestFile(dirname).c_str());
+  std::string line;
+  while (std::getline(t, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    std::istringstream is(line);
+    MarshalEntry e;
+    if (!(is >> e.filename >> e.channel >> e.iColormap >> e.caption)) {
+      warn("ignoring malformed line in " + manifestFile(dirname) + ": " + line);
+      continue;
+    }
+    entries.push_back(e);
+  }
+  return entries;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// A feature computed by timeliner_pre, persisted in the marshal dir as "featuresN".
+// timeliner_run mmaps it and reads the floats in place.
+//
+// After the header comes the feature's name, nameLength bytes, not null-terminated,
+// then zeros up to offData, a multiple of cbAlign, then slices vectors of vectorsize floats.
+// Because mmap returns page-aligned memory, so are the floats.
+
+struct MarshalHeader {
+  char magic[8];	// "tlmarshl", not null-terminated
+  int version;
+  int iColormap;
+  int vectorsize;
+  int nameLength;
+  int64_t slices;
+  int64_t offData;	// bytes from the start of the file to the first float
+  double period;	// seconds per slice
+
+  enum { versionCur = 2 };
+  enum { cbAlign = 4096 };
+  static const char* magicCur() { return "tlmarshl"; }
+
+  MarshalHeader() { memset(this, 0, sizeof(*this)); }
+
+  static int64_t align(const int64_t cb) { return (cb + cbAlign-1) / cbAlign * cbAlign; }
+  int64_t cz() const { return slices * vectorsize; }
+
+  // Consistent with itself and with a file of cch bytes, without reading the floats.
+  bool valid(const int64_t cch) const {
+    return cch >= int64_t(sizeof(*this)) &&
+      !memcmp(magic, magicCur(), sizeof(magic)) && version == versionCur &&
+      iColormap >= 0 && vectorsize >= 1 && nameLength >= 0 && slices >= 1 && period > 0.0 &&
+      offData % cbAlign == 0 && offData >= int64_t(sizeof(*this)) + nameLength &&
+      cch >= offData + cz() * int64_t(sizeof(float));
+  }
+};
+
+// The marshal dir's "manifest" lists every feature that timeliner_pre computed, in order, one per line:
+// its marshal file, the channel it came from, its colormap, and its caption, which has no spaces.
+// Blank lines and lines starting with '#' are ignored.
+// timeliner_pre writes it after all the features are done, so a manifest's features are complete.
+
+struct MarshalEntry {
+  std::string filename;	// in the marshal dir
+  int channel;
+  int iColormap;
+  std::string caption;
+};
+
+bool writeManifest(const std::string& dirname, const std::vector<MarshalEntry>&);
+std::vector<MarshalEntry> readManifest(const std::string& dirname); // Empty if there's no manifest.
@@ -0,0 +1,66 @@
+#include "timeliner_mipmap.h"
+
+#include <algorithm>
+#include <cassert>
+
+// RGTC1 aka BC4, www.opengl.org/registry/specs/ARB/texture_compression_rgtc.txt
+// A block is red0, red1, then sixteen 3-bit codes, row by row, least significant bits first.
+// With red0 > red1, code 0 is red0, code 1 is red1, and codes 2..7 interpolate from red0 to red1.
+
+// Texel (x,y) of the 4x4 block at (x0,y0), replicating edge texels into any padding.
+static inline unsigned char texel(const unsigned char* src, const int width, const int height, const int x, const int y) {
+  return src[std::min(y, height-1)*width + std::min(x, width-1)];
+}
+
+static void bc4EncodeBlock(const unsigned char* src, const int width, const int height, const int x0, const int y0, unsigned char* dst) {
+  unsigned char a[16];
+  for (int i=0; i<16; ++i)
+    a[i] = texel(src, width, height, x0 + i%4, y0 + i/4);
+  const unsigned char zMin = *std::min_element(a, a+16);
+  const unsigned char zMax = *std::max_element(a, a+16);
+  dst[0] = zMax;
+  dst[1] = zMin;
+  unsigned long long codes = 0;
+  if (zMax > zMin) {
+    const int dz = zMax - zMin;
+    for (int i=0; i<16; ++i) {
+      // Nearest of the 8 steps from zMin (k==0) to zMax (k==7).
+      const int k = ((a[i] - zMin) * 14 + dz) / (2*dz);
+      const int code = k==7 ? 0 : k==0 ? 1 : 8-k;
+      codes |= (unsigned long long)code << (3*i);
+    }
+  }
+  for (int i=0; i<6; ++i)
+    dst[2+i] = (unsigned char)(codes >> (8*i));
+}
+
+// Compress a width x height image of bytes into bc4Bytes(width, height) bytes.
+void bc4Encode(const unsigned char* src, const int width, const int height, unsigned char* dst) {
+  for (int y=0; y<height; y+=4)
+    for (int x=0; x<width; x+=4, dst+=8)
+      bc4EncodeBlock(src, width, height, x, y, dst);
+}
+
+// Inverse of bc4Encode, for GPUs without RGTC.
+void bc4Decode(const unsigned char* src, const int width, const int height, unsigned char* dst) {
+  for (int y0=0; y0<height; y0+=4) {
+    for (int x0=0; x0<width; x0+=4, src+=8) {
+      const int r0 = src[0];
+      const int r1 = src[1];
+      int palette[8] = { r0, r1 };
+      for (int c=2; c<8; ++c)
+	palette[c] = r0 > r1 ? ((8-c)*r0 + (c-1)*r1 + 3) / 7 :
+	             c < 6   ? ((6-c)*r0 + (c-1)*r1 + 2) / 5 :
+	             c == 6  ? 0 : 255;
+      unsigned long long codes = 0;
+      for (int i=0; i<6; ++i)
+	codes |= (unsigned long long)src[2+i] << (8*i);
+      for (int i=0; i<16; ++i) {
+	const int x = x0 + i%4;
+	const int y = y0 + i/4;
+	if (x < width && y < height)
+	  dst[y*width + x] = (unsigned char)palette[(codes >> (3*i)) & 7];
+      }
+    }
+  }
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include <cstdlib>
+#include <cstring>
+
+// Mipmaps precomputed by timeliner_pre, persisted in the marshal dir as "featuresN.mip"
+// next to the feature "featuresN" they were computed from.
+// timeliner_run mmaps them and uploads them directly, instead of building a CHello.
+//
+// After the header come the levels, finest first.
+// Each level holds cchunk chunks, left to right.
+// Each chunk holds vectorsize rows of widthChunk(level) bytes, as made by CHello::getbatchByte,
+// or, if format is formatBC4, that image compressed as RGTC1 aka BC4 (see bc4Encode).
+
+struct MipmapHeader {
+  char magic[8];	// "tlmipmap", not null-terminated
+  int version;
+  int subsample;	// timeliner_zoom
+  int width;		// texels across all chunks, at level 0
+  int cchunk;		// chunks per level
+  int vectorsize;
+  int iColormap;
+  int format;		// formatBytes or formatBC4
+  double tBound[2];	// seconds spanned by all chunks, i.e. timeliner_run's tShowBound
+
+  enum { versionCur = 2 };
+  enum { formatBytes, formatBC4 };
+  static const char* magicCur() { return "tlmipmap"; }
+
+  MipmapHeader() { memset(this, 0, sizeof(*this)); }
+
+  bool valid() const {
+    return !memcmp(magic, magicCur(), sizeof(magic)) && version == versionCur &&
+      subsample >= 1 && width >= 1 && cchunk >= 1 && width % cchunk == 0 && vectorsize >= 1 &&
+      (format == formatBytes || format == formatBC4);
+  }
+
+  int widthChunk(const int level) const { return (width/cchunk) >> level; }
+  int levels() const { int c=0; while (widthChunk(c) >= 1) ++c; return c; }
+  long chunkBytes(const int level) const;
+
+  // Offset from start of payload to a chunk's first row.
+  long offset(const int level, const int ichunk) const {
+    long cb = 0;
+    for (int l=0; l<level; ++l)
+      cb += cchunk * chunkBytes(l);
+    return cb + ichunk * chunkBytes(level);
+  }
+  long payload() const { return offset(levels(), 0); }
+};
+
+// RGTC1 aka BC4: each 4x4 block of texels is 8 bytes, half of GL_INTENSITY8's 16.
+// Partial blocks at the right and top edges are padded.
+inline long bc4Bytes(const int width, const int height) { return long((width+3)/4) * ((height+3)/4) * 8; }
+void bc4Encode(const unsigned char* src, int width, int height, unsigned char* dst);
+void bc4Decode(const unsigned char* src, int width, int height, unsigned char* dst);
+
+inline long MipmapHeader::chunkBytes(const int level) const {
+  return format == formatBC4 ? bc4Bytes(widthChunk(level), vectorsize) : long(vectorsize) * widthChunk(level);
+}
+
+// Whether to store feature textures compressed, from the environment variable timeliner_compress.
+inline bool mipmapCompress() {
+  const char* pch = getenv("timeliner_compress");
+  return pch && atoi(pch) != 0;
+}
+
+// Undersampling requested by the environment variable timeliner_zoom.
+inline unsigned mipmapSubsample() {
+  const char* pch = getenv("timeliner_zoom");
+  const int subsample = pch ? atoi(pch) : 1;
+  return subsample < 1 ? 1 : subsample;
+}
+
+// Whether timeliner_zoom overrides timeliner_run's automatic undersampling.
+inline bool mipmapSubsampleFixed() {
+  return getenv("timeliner_zoom") != NULL;
+}
+
+// Smallest power of two that exceeds a feature's # of samples.
+inline unsigned mipmapWidth(const int csample, const unsigned subsample) {
+  unsigned width = 1;
+  while (width < csample/subsample)
+    width *= 2;
+  return width;
+}
+
+// Minimize cchunk to conserve RAM and increase FPS.
+inline int mipmapChunks(const unsigned width, const unsigned widthLim) {
+  return width<widthLim ? 1 : width/widthLim;
+}
@@ -13,6 +13,7 @@
 #include <cfloat>
 #include <cmath>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
 #include <fstream>
@@ -27,13 +28,15 @@
 #include <functional>			// not1
 #include <cctype>				// isspace (NOT <locale>, so it works with std::ptr_fun)
 #include <direct.h>				// _getcwd
+#include <sys/types.h>
+#include <sys/stat.h>				// stat
 #define getcwd(a,b) _getcwd(a,b)
 #define mkdir(a,b)  _mkdir(a)
 #define chdir(a)    _chdir(a)
 inline double round(const double x) { return floor(x + 0.5); }
 #else
 #include <arpa/inet.h> // ntohl(), etc
-#include <gsl/gsl_wavelet.h> // apt install libgsl-dev
+#include <dirent.h>
 #include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
@@ -50,7 +53,12 @@ std::string dirMarshal = ".timeliner_marshal";
 std::string configfile = "timeliner_config.txt";
 
 #include "timeliner_cache.h"
+#include "timeliner_frontend.h"
+#include "timeliner_marshal.h"
+#include "timeliner_mipmap.h"
 #include "timeliner_util.h"
+#include "timeliner_util_threads.h"
+#include "timeliner_wavelet.h"
 
 // C++-11 deprecates this with std::to_string().
 template <typename T> std::string to_str(const T& t) { std::ostringstream os; os << t; return os.str(); }
@@ -63,189 +71,487 @@ void fileFromBuf(const std::string& outfilename, const char* pb, const long cb)
   std::ofstream t(outfilename.c_str(), std::ios_base::binary | std::ios_base::out);
   t.write(pb, cb);
 }
-void fileFromBufs(const std::string& outfilename, const char* pb, const long cb, const float* pz, const long cz) {
-  std::ofstream t(outfilename.c_str(), std::ios_base::binary | std::ios_base::out);
-  // Header of bytes.  Body of floats.
-  t.write(pb, cb);
-  t.write((const char*)pz, cz*sizeof(float));
+
+// A file's name, size and modification time, which change when it does, without reading it.
+std::string fileIdentity(const std::string& filename) {
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0)
+    return filename;
+  return filename + " " + to_str(st.st_size) + " " + to_str(st.st_mtime);
 }
 
-short** rawS16 = NULL;
-long wavcsamp = -1;
-int SR = -1;
+// 64-bit FNV-1a, as 16 hex digits.
+std::string hashHex(const std::string& s) {
+  unsigned long long h = 14695981039346656037ULL;
+  for (size_t i=0; i<s.size(); ++i) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ULL;
+  }
+  char sz[17];
+  snprintf(sz, sizeof(sz), "%016llx", h);
+  return sz;
+}
 
 #ifndef M_PI
 #define M_PI (3.1415926535898)
 #endif
-double* hamming(int w) {
-  double* a = new double[w];
-  for (int n=0; n<w; ++n)
-    a[n] = 0.54 - 0.46 * cos(2.0*M_PI*n / (w-1.0));
-  return a;
-}
 
-// Modifies rgz in-place (with htonl()).
-std::string writeHTK(const std::string& outfile, float* rgz, const long cz, const unsigned floatsPerSlice, const unsigned long sampPeriodHNSU) {
-  if (cz <= 0)
-    quit("refused to write HTK file with no data");
-  for (int i=0; i<cz; ++i) {
-    unsigned* pw = reinterpret_cast<unsigned*>(rgz+i);
-    *pw = htonl(*pw);
-  }
-  const size_t cb = 12;
-  char rgb[cb];
-  // Explicit pw avoids the g++ 4.6.3 warning "dereferencing type-punned pointer will break strict-aliasing rules."
-  unsigned* pw = reinterpret_cast<unsigned*>(rgb+0); *pw = htonl(cz/floatsPerSlice);
-  *reinterpret_cast<unsigned*>(rgb+4)                    = htonl(sampPeriodHNSU);
-  *reinterpret_cast<unsigned short*>(rgb+ 8) = htons(sizeof(float)*floatsPerSlice);
-  *reinterpret_cast<unsigned short*>(rgb+10) = htons(9);
-  fileFromBufs(outfile, rgb, cb, rgz, cz);
-  return outfile;
-}
+int formatMixed = SF_FORMAT_WAV | SF_FORMAT_PCM_16; // of mixed.wav
+int numchans = 62; // frequency bands per filterbank or mfcc
+int waveletWindow = 32; // samples per wavelet transform, a power of two
+long waveletStride = -1; // samples between wavelet slices, or -1 for sampPeriodF's worth
+const unsigned long sampPeriodF = 100000; // hnsu, hundreds of nanoseconds, i.e. 1e-7 seconds, or decimicroseconds.
 
-std::string writeHTKWavelet(const int channel, const std::string& fileOut, const unsigned long sampPeriodHNSU) {
-#ifdef _MSC_VER
-	warn("wavelets nyi in Windows, because the port of GNU GSL is ancient and unmaintained.");
-	return fileOut;
-#else
-  const unsigned cSampWindow = 32;
-  gsl_wavelet* w = gsl_wavelet_alloc(gsl_wavelet_daubechies_centered, 4);
-  gsl_wavelet_workspace* workspace = gsl_wavelet_workspace_alloc(cSampWindow);
-  const float sSamp = float(sampPeriodHNSU) / 1e7;
-  const size_t stride = sSamp * SR;
-  if (cSampWindow < stride)
-    warn("wavelet window is shorter than stride, so samples between windows will be ignored");
-  double* weights = hamming(cSampWindow);
-  const float cSamp = wavcsamp;
-  float iSamp = 0.0;
-  double* data = new double[cSampWindow];
-  float* r = new float[cSampWindow * unsigned(cSamp/stride + 1)];
-  long iz = 0;
-  while (iSamp+cSampWindow < cSamp) {
-    const unsigned i = unsigned(iSamp);
-
-    // Read data, and convolve it with Hamming window.
-    unsigned j;
-    for (j=0; j<cSampWindow; ++j)
-      data[j] = double(rawS16[channel][i+j]) * weights[j];
-
-    // Apply wavelet transform to data[], in place.
-    (void)gsl_wavelet_transform_forward(w, data, 1, cSampWindow, workspace);
-
-    // Append this vector of wavelet coeffs to r[].
-    for (j=0; j<cSampWindow; ++j)
-      r[iz + j] = float(data[j]);
-    iz += cSampWindow;
-    iSamp += stride;
-  }
-  delete [] data;
-  delete [] weights;
-  gsl_wavelet_workspace_free(workspace);
-  gsl_wavelet_free(w);
-  const std::string s = writeHTK(fileOut, r, iz, cSampWindow, sampPeriodHNSU);
-  delete [] r;
-  return s;
-#endif
-}
+// Neither a recording nor a feature need fit in memory:  they're processed about this many samples or floats at a time.
+const long cBlock = 1L << 20;
 
-long wavcsamp_fake = -1;
-int channels_fake = -1;
-unsigned channels = 1;  // mono, stereo, etc
-int numchans = 62; // frequency bands per filterbank, mfcc, or wavelet
-const unsigned long sampPeriodF = 100000;
-const std::string sampPeriod = "100000.0"; // hnsu, hundreds of nanoseconds, i.e. 1e-7 seconds, or decimicroseconds.
-const std::string sampPeriodTimes8 = "800000.0";
+// Where features get their samples:  a window at a time, one channel at a time,
+// from the source recording, without reading all of it into memory.
+// Channels may differ in sample rate, but not in duration.
+// From any thread.
+class Recording {
+public:
+  virtual ~Recording() {}
+  virtual unsigned channels() const = 0;
+  virtual long csamp(unsigned channel) const = 0;
+  virtual double rate(unsigned channel) const = 0; // samples per second, exactly, maybe fractional
+  int sr(const unsigned channel) const { return int(floor(rate(channel) + 0.5)); } // for a wav header
+
+  // Copy samples [s0, s0+n) of a channel to dst.
+  virtual void read(unsigned channel, long s0, long n, short* dst) = 0;
+
+  // Copy frames [s0, s0+n) of channels [0, cChannel), which share a sample rate, interleaved, to dst.
+  virtual void readFrames(const long s0, const long n, const unsigned cChannel, short* dst) {
+    std::vector<short> buf(n);
+    for (unsigned i=0; i<cChannel; ++i) {
+      read(i, s0, n, &buf[0]);
+      for (long j=0; j<n; ++j)
+	dst[j*cChannel + i] = buf[j];
+    }
+  }
+};
 
-#ifdef _MSC_VER
-const std::string Hcfg = "c:\\temp\\timeliner_hcopy.cfg";
-const std::string Outfile = "c:\\temp\\timeliner_htk";
-// TODO: instead of c:\\temp use _dupenv_s(&pch, &cch, "TEMP"), and then free cch.  Ditto for channel.wav.
-#else
-const std::string Hcfg = "/tmp/timeliner_hcopy.cfg";
-const std::string Outfile = "/tmp/timeliner_htk";
-#endif
-std::string htkFromWav(const int channel, int iKind, const std::string& infile) {
-  if (iKind < 0 || iKind >= 4)
-    return infile;
-  if (iKind == 3) {
-#ifdef _MSC_VER
-    warn("wavelets nyi in Windows; using filterbank instead.");
-    iKind = 0;
-#else
-    return writeHTKWavelet(channel, Outfile, sampPeriodF);
-#endif
+// Any format that libsndfile reads, converted to 16-bit samples as it's read.
+// Reads take turns, because libsndfile's handle isn't thread-safe.
+class SndfileRecording : public Recording {
+  const std::string _filename;
+  const long _csamp;		// per channel
+  const unsigned _channels;
+  const int _sr;
+  std::vector<SNDFILE*> _idle;	// Handles that no reader is using.
+  pthread_mutex_t _mutex;	// Guards only _idle, so readers decode in parallel.
+
+  // A handle of the caller's own, so its seek and read don't disturb other readers'.
+  // Opens another only when all are in use, so there are at most as many as concurrent readers.
+  SNDFILE* acquire() {
+    SNDFILE* pf = NULL;
+    pthread_mutex_lock(&_mutex);
+    if (!_idle.empty()) {
+      pf = _idle.back();
+      _idle.pop_back();
+    }
+    pthread_mutex_unlock(&_mutex);
+    if (pf)
+      return pf;
+    SF_INFO sfinfo;
+    memset(&sfinfo, 0, sizeof(sfinfo));
+    pf = sf_open(_filename.c_str(), SFM_READ, &sfinfo);
+    if (!pf)
+      quit("failed to reopen recording " + _filename);
+    (void)sf_command(pf, SFC_SET_CLIPPING, NULL, SF_TRUE);
+    return pf;
+  }
+  void release(SNDFILE* pf) {
+    pthread_mutex_lock(&_mutex);
+    _idle.push_back(pf);
+    pthread_mutex_unlock(&_mutex);
   }
-  if (iKind == 2)
-    warn("Quicknet (qnsfws, feacat) support nyi.");
-
-  // Use current value of numchans, not the compile-time default.
-  const std::string ConfigCommon = "\
-    USEHAMMING = T\n\
-    ZMEANSOURCE = T\n\
-    WINDOWSIZE = " + sampPeriodTimes8 + "\n\
-    NUMCHANS = " + to_str(numchans) + "\n\
-    HIFREQ = " + to_str(SR/2) + "\n\
-    LOFREQ = 0\n\
-    SOURCEFORMAT = WAV\n\
-    USEPOWER = T\n\
-    TARGETRATE = " + sampPeriod + "\n\
-    PREEMCOEF = 0.97\n\
-    ";
-  const std::string Config[3] = {
-    "TARGETKIND = FBANK_Z\n",
-    "TARGETKIND = MFCC_Z\nNUMCEPS = " + to_str(numchans) + "\n",
-    "TARGETKIND = FBANK_D_A_Z\n"
-  };
-  fileFromString(Hcfg, ConfigCommon + Config[iKind]);
-  (void)remove(Outfile.c_str()); // Mere paranoia.  The file really shouldn't be there.
 
-#ifdef _MSC_VER
-  const std::string channelfile = "c:\\temp\\channel.wav";
-#else
-  const std::string channelfile = "/tmp/channel.wav";
-#endif
+  // Read frames [s0, s0+n), at most cBlock shorts at a time,
+  // handing each piece to copy(piece, first frame, frames).
+  template <class F> void readPieces(const long s0, const long n, F copy) {
+    const long cFrameMax = std::max(1L, cBlock / long(_channels));
+    SNDFILE* pf = acquire();
+    if (sf_seek(pf, s0, SEEK_SET) < 0)
+      quit("failed to seek in recording");
+    std::vector<short> interleaved(std::min(n, cFrameMax) * _channels);
+    for (long done=0; done<n; ) {
+      const long c = std::min(n - done, cFrameMax);
+      if (sf_readf_short(pf, &interleaved[0], c) != c)
+	quit("failed to read recording");
+      copy(&interleaved[0], done, c);
+      done += c;
+    }
+    release(pf);
+  }
+public:
+  // Owns pf, which must already clip.
+  SndfileRecording(const std::string& filename, SNDFILE* pf, const SF_INFO& sfinfo) :
+    _filename(filename), _csamp(long(sfinfo.frames)), _channels(sfinfo.channels), _sr(sfinfo.samplerate), _idle(1, pf)
+    { pthread_mutex_init(&_mutex, NULL); }
+  ~SndfileRecording() {
+    pthread_mutex_destroy(&_mutex);
+    for (std::vector<SNDFILE*>::const_iterator it = _idle.begin(); it != _idle.end(); ++it)
+      if (0 != sf_close(*it))
+	warn("failed to close recording");
+  }
+  unsigned channels() const { return _channels; }
+  long csamp(unsigned) const { return _csamp; }
+  double rate(unsigned) const { return _sr; }
+
+  void read(const unsigned channel, const long s0, const long n, short* dst) {
+    assert(channel < _channels && s0 >= 0 && n >= 0 && s0+n <= _csamp);
+    const unsigned channels = _channels;
+    readPieces(s0, n, [=](const short* ps, long done, long c) {
+      for (long j=0; j<c; ++j)
+	dst[done + j] = ps[j*channels + channel];
+    });
+  }
 
-  // Create channelfile from rawS16[channel].
+  void readFrames(const long s0, const long n, const unsigned cChannel, short* dst) {
+    assert(cChannel <= _channels && s0 >= 0 && n >= 0 && s0+n <= _csamp);
+    const unsigned channels = _channels;
+    readPieces(s0, n, [=](const short* ps, long done, long c) {
+      for (long j=0; j<c; ++j)
+	std::copy(ps + j*channels, ps + j*channels + cChannel, dst + (done + j)*cChannel);
+    });
+  }
+};
+
+// EDF or EDF+ (European Data Format, www.edfplus.info/specs/edf.html ), e.g. a clinical EEG recording.
+// After the header come data records, each the same duration of every signal:
+// all of signal 0's samples in that record, then all of signal 1's, and so on, as little-endian shorts.
+// Signals may have different numbers of samples per record, i.e. different sample rates.
+// Each channel is one signal, except for EDF+ annotations, which are skipped.
+// Reads come straight from an mmap of the file, a record at a time, so they needn't take turns.
+class EdfRecording : public Recording {
+  const std::string _filename;
+  const Mmap _edf;
+  const short* _data;		// first record
+  long _records;
+  long _shortsPerRecord;
+  std::vector<long> _nsp;	// per channel, samples per record
+  std::vector<long> _offset;	// per channel, shorts from a record's start to its first sample
+  std::vector<double> _rate;	// per channel
+
+  // A header field, from its fixed-width ASCII.
+  static std::string field(const char* pch, const int cch) {
+    std::string s(pch, cch);
+    const size_t last = s.find_last_not_of(' ');
+    return last == std::string::npos ? std::string() : s.substr(0, last+1);
+  }
+  long number(const char* pch, const int cch) const {
+    const std::string s = field(pch, cch);
+    char* end;
+    const long l = strtol(s.c_str(), &end, 10);
+    if (s.empty() || *end != '\0')
+      quit("corrupt header field '" + s + "' in EDF file " + _filename);
+    return l;
+  }
+
+public:
+  EdfRecording(const std::string& filename) : _filename(filename), _edf(filename, false) {
+    const char* pch = _edf.pch();
+    const off_t cch = _edf.cch();
+    if (cch == 0)
+      quit("empty EDF file " + filename);
+    if (cch < 256)
+      quit("truncated global header in EDF file " + filename);
+    const long bytesInHeader = number(pch+184, 8);
+    long records = number(pch+236, 8);	// -1 if unknown
+    const double secondsPerRecord = strtod(field(pch+244, 8).c_str(), NULL);
+    const long signals = number(pch+252, 4);
+    const std::string reserved = field(pch+192, 44);
+    if (signals <= 0 || bytesInHeader != 256 + signals*256 || secondsPerRecord <= 0.0)
+      quit("corrupt global header in EDF file " + filename);
+    if (cch < bytesInHeader)
+      quit("truncated per-signal header in EDF file " + filename);
+    if (reserved.compare(0, 5, "EDF+D") == 0)
+      warn("EDF+ file " + filename + " is discontinuous, but its records will be shown back to back");
+
+    // Per-signal fields, each an array of one per signal:
+    // label 16, transducer 80, physical dimension 8, physical min and max 8 each, digital min and max 8 each,
+    // prefiltering 80, samples per record 8, reserved 32.
+    const char* pchLabel = pch + 256;
+    const char* pchNsp = pch + 256 + signals*(16+80+8+8+8+8+8+80);
+    _shortsPerRecord = 0;
+    for (long i=0; i<signals; ++i) {
+      const std::string label = field(pchLabel + i*16, 16);
+      const long nsp = number(pchNsp + i*8, 8);
+      if (nsp <= 0)
+	quit("corrupt samples per record in EDF file " + filename);
+      if (label != "EDF Annotations") {
+	const double sr = nsp / secondsPerRecord;
+	info("EDF channel " + to_str(_nsp.size()) + " is " + label + ", " + to_str(sr) + " Hz");
+	_nsp.push_back(nsp);
+	_offset.push_back(_shortsPerRecord);
+	_rate.push_back(sr);
+      }
+      _shortsPerRecord += nsp;
+    }
+    if (_nsp.empty())
+      quit("no signals in EDF file " + filename);
+
+    const long recordsInFile = long((cch - bytesInHeader) / (_shortsPerRecord * sizeof(short)));
+    if (records < 0)
+      records = recordsInFile;
+    else if (records > recordsInFile) {
+      warn("EDF file " + filename + " is truncated to " + to_str(recordsInFile) + " of " + to_str(records) + " records");
+      records = recordsInFile;
+    }
+    if (records <= 0)
+      quit("no data records in EDF file " + filename);
+    _records = records;
+    _data = (const short*)(pch + bytesInHeader);
+    info(to_str(_records) + " records of " + to_str(secondsPerRecord) + " s, " + to_str(_nsp.size()) + " channels");
+  }
+
+  unsigned channels() const { return unsigned(_nsp.size()); }
+  long csamp(const unsigned channel) const { return _records * _nsp[channel]; }
+  double rate(const unsigned channel) const { return _rate[channel]; }
+
+  void read(const unsigned channel, const long s0, const long n, short* dst) {
+    assert(channel < channels() && s0 >= 0 && n >= 0 && s0+n <= csamp(channel));
+    const long nsp = _nsp[channel];
+    for (long s=s0; s<s0+n; ) {
+      const long k = s % nsp;
+      const long c = std::min(nsp - k, s0 + n - s);
+      const short* ps = _data + (s / nsp) * _shortsPerRecord + _offset[channel] + k;
+      std::copy(ps, ps + c, dst + (s - s0));
+      s += c;
+    }
+  }
+};
+
+// Format of mixed.wav, timeliner_run's playback file, from the config file's mixedformat=,
+// or 0 if unrecognized.  Whatever the format, libsndfile recognizes it from its contents, not its name.
+int mixedFormat(const std::string& name)
+{
+  if (name == "wav16") return SF_FORMAT_WAV  | SF_FORMAT_PCM_16;
+  if (name == "wav24") return SF_FORMAT_WAV  | SF_FORMAT_PCM_24;
+  if (name == "float") return SF_FORMAT_WAV  | SF_FORMAT_FLOAT;
+  if (name == "flac")  return SF_FORMAT_FLAC | SF_FORMAT_PCM_16;
+  return 0;
+}
+
+// Create mixed.wav in formatMixed.
+SNDFILE* openMixed(const std::string& mixedfile, const int sr, const unsigned channels)
+{
   SF_INFO sfinfo;
-  sfinfo.samplerate = SR;
-  sfinfo.channels = 1;
-  sfinfo.format = SF_FORMAT_WAV|SF_FORMAT_PCM_16;
-  SNDFILE* pf = sf_open(channelfile.c_str(), SFM_WRITE, &sfinfo);
+  memset(&sfinfo, 0, sizeof(sfinfo));
+  sfinfo.samplerate = sr;
+  sfinfo.channels = channels;
+  sfinfo.format = formatMixed;
+  if (!sf_format_check(&sfinfo))
+    quit("mixedformat can't hold " + to_str(channels) + " channels at " + to_str(sr) + " Hz");
+  (void)remove(mixedfile.c_str()); // Not through a symlink that an earlier run made to some recording.
+  SNDFILE* pf = sf_open(mixedfile.c_str(), SFM_WRITE, &sfinfo);
   if (!pf) {
 #ifdef _MSC_VER
     char buf[MAX_PATH];
-    (void)GetFullPathNameA(channelfile.c_str(), MAX_PATH, buf, NULL);
-    quit(std::string("no wav file ") + std::string(buf));
+    (void)GetFullPathNameA(mixedfile.c_str(), MAX_PATH, buf, NULL);
+    quit(std::string("failed to create wav file ") + std::string(buf));
 #else
-    quit("no wav file");
+    quit("failed to create mixed-wav file " + mixedfile);
 #endif
   }
-  if (channels_fake < 0) channels_fake = channels;
-  if (wavcsamp_fake < 0) wavcsamp_fake = wavcsamp;
-  printf("channel %d of %d\n", channel, channels_fake);;;;
-  const sf_count_t c = sf_writef_short(pf, rawS16[channel], wavcsamp_fake);
-  if (wavcsamp_fake != c) {
-    quit("problem writing 1-channel .wav file " + channelfile);
+  return pf;
+}
+
+// Convert the recording's first few channels to mixed.wav, a block at a time, while features are computed from it.
+class WriteMixed : public Task {
+  WorkerPool& _pool;
+  Recording& _rec;
+  const unsigned _channels;
+  SNDFILE* const _pf;
+  const std::string _filename;
+  const long _cb; // admitted by whoever submitted this
+public:
+  WriteMixed(WorkerPool& pool, Recording& rec, unsigned channels, SNDFILE* pf, const std::string& filename, long cb) :
+    _pool(pool), _rec(rec), _channels(channels), _pf(pf), _filename(filename), _cb(cb) {}
+  void work() const {
+    const long cFrame = framesPerBlock(_channels);
+    const long csamp = _rec.csamp(0);
+    std::vector<short> buf(cFrame * _channels);
+    for (long s0=0; s0<csamp; s0+=cFrame) {
+      const long c = std::min(cFrame, csamp - s0);
+      _rec.readFrames(s0, c, _channels, &buf[0]);
+      if (sf_writef_short(_pf, &buf[0], c) != c)
+	quit("problem writing mixed-wav file " + _filename);
+    }
+    if (0 != sf_close(_pf))
+      warn("failed to close mixed-wav file " + _filename);
+    _pool.release(_cb);
+  }
+  void abandon() const {
+    (void)sf_close(_pf);
+    _pool.release(_cb);
+  }
+  static long framesPerBlock(const unsigned channels) { return std::max(1L, cBlock / long(channels)); }
+  // Bytes that work() holds at once, about, including what readFrames() might.
+  static long cbWork(const unsigned channels) { return 2 * framesPerBlock(channels) * channels * sizeof(short); }
+};
+
+// Per-coefficient extremes and sum of some whole vectors, for MarshalFile::finish() to normalize with.
+// Each shard accumulates its own, in parallel, so the appender needn't make another pass.
+struct VectorStats {
+  std::vector<float> zMin, zMax;
+  std::vector<double> zSum;
+  void reset(const int vectorsize) {
+    zMin.assign(vectorsize,  FLT_MAX);
+    zMax.assign(vectorsize, -FLT_MAX);
+    zSum.assign(vectorsize, 0.0);
+  }
+  void add(const float* pz, const long cz) {
+    const int vectorsize = int(zMin.size());
+    assert(vectorsize > 0 && cz % vectorsize == 0);
+    float* __restrict lo = &zMin[0];
+    float* __restrict hi = &zMax[0];
+    double* __restrict sum = &zSum[0];
+    for (long i=0; i<cz; i+=vectorsize) {
+      const float* __restrict v = pz + i;
+      for (int c=0; c<vectorsize; ++c) {
+	lo[c] = std::min(lo[c], v[c]);
+	hi[c] = std::max(hi[c], v[c]);
+	sum[c] += v[c];
+      }
+    }
   }
-  if (0 != sf_close(pf))
-    warn("failed to close wav");
+  void merge(const VectorStats& rhs) {
+    assert(rhs.zMin.size() == zMin.size());
+    for (size_t c=0; c<zMin.size(); ++c) {
+      zMin[c] = std::min(zMin[c], rhs.zMin[c]);
+      zMax[c] = std::max(zMax[c], rhs.zMax[c]);
+      zSum[c] += rhs.zSum[c];
+    }
+  }
+};
 
-  if (-1 == system(("HCopy -A -T 1 -C " + Hcfg + " " + channelfile + " " + Outfile).c_str()))
-    quit("system(HCopy) failed");
-  if (0 != remove(channelfile.c_str()))
-    quit("failed to remove " + channelfile);
-  if (0 != remove(Hcfg.c_str()))
-    quit("failed to remove " + Hcfg);
+// A feature's marshal file, written as its vectors are computed:  a MarshalHeader, the feature's name,
+// padding, then the vectors.  timeliner_run's Feature::binaryload() reads it.
+class MarshalFile {
+  std::fstream _f;
+  const std::string _name;
+  MarshalHeader _h;
+  double _period;
+  int _vectorsize;
+  long _cz;
+  VectorStats _stats;
+public:
+  MarshalFile(const std::string& filename, const std::string& name, const int iColormap) :
+    _f(filename.c_str(), std::ios_base::binary | std::ios_base::in | std::ios_base::out | std::ios_base::trunc),
+    _name(name),
+    _period(0.0),
+    _vectorsize(0),
+    _cz(0)
+  {
+    if (!_f.good())
+      quit("failed to create marshal file " + filename);
+    memcpy(_h.magic, MarshalHeader::magicCur(), sizeof(_h.magic));
+    _h.version = MarshalHeader::versionCur;
+    _h.iColormap = iColormap;
+    _h.nameLength = int(name.size());
+    _h.offData = MarshalHeader::align(sizeof(_h) + name.size());
+    // The rest, finish() fills in.
+    _f.write((const char*)&_h, sizeof(_h));
+    _f.write(name.c_str(), name.size());
+    // Zeros up to offData.
+    while (_f.tellp() < _h.offData)
+      _f.put(0);
+  }
 
-  return Outfile;
-}
+  double period() const { return _period; }
+  int vectorsize() const { return _vectorsize; }
+  long cz() const { return _cz; }
 
-void readHTK(const std::string& caption, const std::string& filename,
-    double& period, int& vectorsize, float*& data, size_t& cz)
+  // Before any append().
+  void begin(const double period, const int vectorsize) {
+    assert(period > 0.0 && vectorsize > 0);
+    _period = period;
+    _vectorsize = vectorsize;
+    _stats.reset(vectorsize);
+  }
+
+  // Whole vectors, whose stats the caller already accumulated.
+  void append(const float* pz, const long cz, const VectorStats& stats) {
+    assert(_vectorsize > 0 && cz % _vectorsize == 0);
+    _stats.merge(stats);
+#ifndef NDEBUG
+#ifndef _MSC_VER
+    // VS2013 only got std::isnormal and std::fpclassify in July 2013:
+    // http://blogs.msdn.com/b/vcblog/archive/2013/07/19/c99-library-support-in-visual-studio-2013.aspx
+    for (long i=0; i<cz; ++i) {
+      if (!std::isnormal(pz[i]) && pz[i] != 0.0) {
+	printf("Feature's float %ld of %ld is bogus: class %d, value %f\n", _cz+i, _cz+cz, std::fpclassify(pz[i]), pz[i]);
+	quit("");
+      }
+    }
+#endif
+#endif
+    _f.write((const char*)pz, cz*sizeof(float));
+    _cz += cz;
+  }
+
+  // If fNormalize, subtract the mean of each of the first cZeroMean coefficients (HTK's _Z qualifier),
+  // then scale everything to 0..1 and optionally invert it, a block at a time, in place.
+  // Then fill in the header, last, so a file with a valid header is complete.
+  void finish(const std::string& caption, const int cZeroMean, const bool fNormalize, const bool fInvert) {
+    if (_cz == 0)
+      quit("no data for feature '" + _name + "'");
+    const long slices = _cz / _vectorsize;
+
+    if (fNormalize) {
+      info("normalizing " + caption);
+      std::vector<float> offset(_vectorsize, 0.0f);
+      for (int c=0; c<cZeroMean; ++c)
+	offset[c] = float(_stats.zSum[c] / slices);
+      float zMin =  FLT_MAX;
+      float zMax = -FLT_MAX;
+      for (int c=0; c<_vectorsize; ++c) {
+	zMin = std::min(zMin, _stats.zMin[c] - offset[c]);
+	zMax = std::max(zMax, _stats.zMax[c] - offset[c]);
+      }
+      float dz = zMax - zMin;
+      if (dz <= 0.0) {
+	// The feature is constant.
+	dz = 1.0;
+      }
+      for (int c=0; c<_vectorsize; ++c)
+	offset[c] += zMin;
+      // Spectrograms (.fb filterbanks) are conventionally black on white, not white on black.
+      const float scale = fInvert ? -1.0f/dz : 1.0f/dz;
+      const float bias = fInvert ? 1.0f : 0.0f;
+
+      const long czBlock = std::max(1L, cBlock / _vectorsize) * _vectorsize;
+      std::vector<float> buf(std::min(czBlock, _cz));
+      for (long i=0; i<_cz; i+=czBlock) {
+	const long cz = std::min(czBlock, _cz - i);
+	const std::streamoff off = _h.offData + std::streamoff(i) * sizeof(float);
+	_f.seekg(off);
+	_f.read((char*)&buf[0], cz*sizeof(float));
+	for (long j=0; j<cz; j+=_vectorsize)
+	  for (int c=0; c<_vectorsize; ++c)
+	    buf[j+c] = (buf[j+c] - offset[c]) * scale + bias;
+	_f.seekp(off);
+	_f.write((const char*)&buf[0], cz*sizeof(float));
+      }
+    }
+    _h.vectorsize = _vectorsize;
+    _h.slices = slices;
+    _h.period = _period;
+    _f.seekp(0);
+    _f.write((const char*)&_h, sizeof(_h));
+    _f.flush();
+    if (!_f.good())
+      quit("failed to write marshal file for feature '" + _name + "'");
+  }
+};
+
+// Parse and check an HTK file's 12-byte header.  4-byte float data follows.
+void readHTK(const std::string& filename, const Mmap& htk, double& period, int& vectorsize, long& slices)
 {
-  const Mmap* foo = new Mmap(filename, false);
-  const char* pch = foo->pch();
-  const unsigned cch = foo->cch();
+  const char* pch = htk.pch();
+  const off_t cch = htk.cch();
   if (!pch)
     quit("missing HTK file " + filename);
   if (cch == 0)
@@ -261,7 +567,7 @@ void readHTK(const std::string& caption, const std::string& filename,
   const unsigned period_hnsu = ntohl(*(unsigned*)pch);			pch += sizeof(unsigned);
   const unsigned short bytesPerSamp = ntohs(*(unsigned short*)pch);	pch += sizeof(unsigned short);
   const unsigned short parmkind = ntohs(*(unsigned short*)pch);		pch += sizeof(unsigned short);
-  assert(pch - foo->pch() == 12);
+  assert(pch - htk.pch() == 12);
 
   const short parmkind_base = parmkind & 077;
   const std::string parmkind_name[11] = {
@@ -277,191 +583,702 @@ void readHTK(const std::string& caption, const std::string& filename,
   if ((parmkind &  02000) != 0) parmkind_qualifiers += "O";
   info("parsed htk header");
 
-  cz = (cch-12) / sizeof(float);
-  data = new float[cz];
-  unsigned i;
-  for (i=0; i<cz; ++i)
-    *(unsigned*)(data+i) = ntohl(((unsigned*)pch)[i]);
-  delete foo;
-  // ;; from start of function to here, move into a separate function so foo needn't be a pointer?
-
+  const long cz = long((cch-12) / sizeof(float));
   const long secs = long(nsamps*period_hnsu / 1e7);
   const unsigned di = bytesPerSamp/4;
-  info("sample kind " + parmkind_name[parmkind_base] + parmkind_qualifiers);
+  info("sample kind " + (parmkind_base < 11 ? parmkind_name[parmkind_base] : to_str(parmkind_base)) + parmkind_qualifiers);
   info(to_str(nsamps) + " samples == " + to_str(secs) + " sec, " + to_str(period_hnsu) + " hnsu, " + to_str(di) + " floats/sample.");
-  if (cz * sizeof(float) != nsamps*bytesPerSamp) {
+  if (cz * sizeof(float) != long(nsamps)*bytesPerSamp) {
     quit("header mismatched body in htk file " + filename);
   }
-  if (bytesPerSamp % 4 != 0)
+  if (bytesPerSamp % 4 != 0 || di == 0)
     quit("sample length not multiple of 4");
-  if (cz != di * nsamps)
+  if (cz != long(di) * nsamps)
     quit("rgz size mismatch");
 
-  info("normalizing " + caption);
-  float zMin =  FLT_MAX;
-  float zMax = -FLT_MAX;
-  for (i=0; i<cz; ++i) {
-    if (data[i] < zMin) zMin = data[i];
-    if (data[i] > zMax) zMax = data[i];
-  }
-  float dz = zMax - zMin;
-  if (dz <= 0.0) {
-    // data[] is constant.
-    dz = 1.0;
-  }
-  for (i=0; i<cz; ++i)
-    data[i] = (data[i] - zMin) / dz;
-
-  // Spectrograms (.fb filterbanks) are conventionally black on white, not white on black.
-  if (filename.find("fb") != std::string::npos) {
-    for (i=0; i<cz; ++i)
-      data[i] = 1.0f - data[i];
-  }
-
   period = period_hnsu/1e7;
   vectorsize = di;
+  slices = nsamps;
 }
 
-class Feature {
-  const int m_iColormap;
-  const std::string m_name;
-  double m_period;
-  int m_vectorsize;
-  float* m_data;
-  size_t m_cz;
+// How to compute a feature from one channel of a recording, as time shards that run in parallel,
+// each a block of consecutive slices (vectors) computed independently of the others.
+// Constructing one only measures the feature, so its memory can be admitted before it's computed.
+class Extractor {
+public:
+  double period;	// seconds per slice
+  int vectorsize;
+  long slices;
+  long slicesPerShard;	// So a shard's samples and vectors are each about cBlock.
+  int cZeroMean;	// Subtract the mean of this many leading coefficients (HTK's _Z).
+  bool fNormalize;
+  bool fInvert;
+  Extractor() : period(0.0), vectorsize(0), slices(0), slicesPerShard(1), cZeroMean(0), fNormalize(true), fInvert(false) {}
+  virtual ~Extractor() {}
+  long cz() const { return slices * vectorsize; }
+  long shards() const { return (slices + slicesPerShard - 1) / slicesPerShard; }
+  // A task that stuffs dst with the vectors of slices [t0, t1).
+  virtual Task* shard(long t0, long t1, float* dst) const = 0;
+  // Also accumulates those vectors into stats, which the caller has reset().
+  // By default, after shard() finishes, while dst is still in cache.
+  virtual Task* shardStats(long t0, long t1, float* dst, VectorStats& stats) const;
+  // Whatever else the vectors depend on, besides the source recording and the fields above.
+  virtual std::string params() const = 0;
+protected:
+  void setShard(const long samplesPerSlice) {
+    slicesPerShard = std::max(1L, std::min(cBlock / vectorsize, cBlock / std::max(1L, samplesPerSlice)));
+  }
+};
 
-  template <class T> const T& min3(const T& a, const T& b, const T& c) const { return std::min(a, std::min(b, c)); }
-  template <class T> const T& max3(const T& a, const T& b, const T& c) const { return std::max(a, std::max(b, c)); }
-  template <class T> const T avg(const T& a, const T& b) { return (a+b)*0.5; }
-  template <class T> const T clamp(const T& tMin, const T& t, const T& tMax) const { return std::min(std::max(tMin, t), tMax); }
+// Some other shard, then its vectors' stats, in the same task.
+class StatsShard : public Task {
+  const Task* const _shard;
+  const float* const _pz;
+  const long _cz;
+  VectorStats& _stats;
+public:
+  StatsShard(const Task* shard, const float* pz, long cz, VectorStats& stats) : _shard(shard), _pz(pz), _cz(cz), _stats(stats) {}
+  ~StatsShard() { delete _shard; }
+  void work() const {
+    _shard->work();
+    _stats.add(_pz, _cz);
+  }
+  void abandon() const { _shard->abandon(); }
+};
 
+Task* Extractor::shardStats(const long t0, const long t1, float* dst, VectorStats& stats) const
+{
+  return new StatsShard(shard(t0, t1, dst), dst, (t1-t0)*vectorsize, stats);
+}
+
+// Bytes that a shard's buffers need, about.
+const long cbShard = cBlock * (sizeof(float) + sizeof(short));
+
+// What HCopy computed for TARGETKIND FBANK_Z, MFCC_Z, or FBANK_D_A_Z.
+class FrontendExtractor : public Extractor {
+  class Shard : public Task {
+    const FrontendExtractor& _x;
+    const long _t0, _t1;
+    float* const _dst;
+  public:
+    Shard(const FrontendExtractor& x, long t0, long t1, float* dst) : _x(x), _t0(t0), _t1(t1), _dst(dst) {}
+    void work() const {
+      // Frontend has scratch buffers, so each shard needs its own.
+      Frontend frontend(_x._kind, _x._rec.rate(_x._channel), numchans);
+      const int vectorsize = _x.vectorsize;
+      // Also compute, on either side, the frames that this shard's deltas depend on.
+      const long margin = frontend.deltaMargin();
+      const long u0 = std::max(0L, _t0 - margin);
+      const long u1 = std::min(_x.slices, _t1 + margin);
+      const long s0 = frontend.frameStart(u0);
+      const long s1 = frontend.frameStart(u1-1) + frontend.frameLength();
+      std::vector<short> samples(s1 - s0);
+      _x._rec.read(_x._channel, s0, s1 - s0, &samples[0]);
+      std::vector<float> vectors((u1 - u0) * vectorsize);
+      for (long t=u0; t<u1; ++t)
+	frontend.frame(&samples[frontend.frameStart(t) - s0], &vectors[(t - u0) * vectorsize]);
+      frontend.deltas(&vectors[0], u1 - u0);
+      std::copy(vectors.begin() + (_t0 - u0) * vectorsize, vectors.begin() + (_t1 - u0) * vectorsize, _dst);
+    }
+  };
+  Recording& _rec;
+  const int _channel;
+  const Frontend::Kind _kind;
 public:
-  Feature(int channel, int iColormap, const std::string& filename, const std::string& caption) :
-    m_iColormap(iColormap),
-    m_name(caption),
-    m_data(NULL),
-    m_cz(0)
-  {
-    std::cout << "Constructing feature from channel " << channel << " of kind " << iColormap << " with caption " << caption << "\n";
-    const std::string htkFilename = htkFromWav(channel, m_iColormap, filename);
-    readHTK(caption, htkFilename, m_period, m_vectorsize, m_data, m_cz);
-    validate();
-    if (0 != remove(htkFilename.c_str()))
-      warn("failed to remove " + htkFilename);
-  }
-
-  Feature(int channel, const std::string& /*filename*/) :
-    m_iColormap(5 /*shader*/ ),
-    m_name("waveform-as-feature"),
-    m_data(NULL),
-    m_cz(0)
+  FrontendExtractor(Recording& rec, const int channel, const int iKind) :
+    _rec(rec), _channel(channel),
+    _kind(iKind == 0 ? Frontend::kindFbank : iKind == 1 ? Frontend::kindMfcc : Frontend::kindFbankDeltas)
   {
-    std::cout << "Constructing waveform-feature for channel " << channel << "\n";
-    m_vectorsize = 50; // number of vertical texels, at most 40 to 50
+    if (iKind == 2)
+      warn("Quicknet (qnsfws, feacat) support nyi.");
+    const Frontend frontend(_kind, rec.rate(channel), numchans);
+    period = frontend.period();
+    vectorsize = frontend.vectorsize();
+    slices = frontend.frames(rec.csamp(channel));
+    cZeroMean = frontend.statics();
+    setShard(frontend.frameStart(1));
+  }
+  Task* shard(long t0, long t1, float* dst) const { return new Shard(*this, t0, t1, dst); }
+  std::string params() const { return "frontend " + to_str(int(_kind)) + " " + to_str(numchans) + " " + to_str(_rec.rate(_channel)) + " " + to_str(_channel); }
+};
 
+// Daubechies wavelet coefficients of windows every stride samples, computed Wavelet::lanes windows at a time.
+// A stride longer than the window gets several windows, spread evenly across it so no samples are skipped,
+// and then each coefficient is the RMS over those windows.
+class WaveletExtractor : public Extractor {
+  class Shard : public Task {
+    const WaveletExtractor& _x;
+    const long _t0, _t1;
+    float* const _dst;
+  public:
+    Shard(const WaveletExtractor& x, long t0, long t1, float* dst) : _x(x), _t0(t0), _t1(t1), _dst(dst) {}
+    void work() const {
+      const int lanes = Wavelet::lanes;
+      const int w = _x.vectorsize;
+      const int k = _x._windowsPerSlice;
+      const long s0 = _x.windowStart(_t0, 0);
+      const long s1 = _x.windowStart(_t1-1, k-1) + w;
+      std::vector<short> samples(s1 - s0);
+      _x._rec.read(_x._channel, s0, s1 - s0, &samples[0]);
+      const long cWindow = (_t1 - _t0) * k;
+      if (k > 1)
+	std::fill(_dst, _dst + (_t1 - _t0) * w, 0.0f);
+
+      Wavelet wavelet(w);
+      std::vector<float> x(w * lanes);
+      for (long j0=0; j0<cWindow; j0+=lanes) {
+	const int c = int(std::min(long(lanes), cWindow - j0));
+	// Gather c windows into the lanes, Hamming-windowed.  Unused lanes stay zero.
+	if (c < lanes)
+	  std::fill(x.begin(), x.end(), 0.0f);
+	for (int l=0; l<c; ++l) {
+	  const long j = j0 + l;
+	  const short* ps = &samples[_x.windowStart(_t0 + j/k, int(j%k)) - s0];
+	  for (int i=0; i<w; ++i)
+	    x[i*lanes + l] = ps[i] * _x._weights[i];
+	}
+	wavelet(&x[0]);
+	// Scatter them back, one vector per slice.
+	for (int l=0; l<c; ++l) {
+	  const long j = j0 + l;
+	  float* r = _dst + (j/k) * w;
+	  if (k == 1)
+	    for (int i=0; i<w; ++i)
+	      r[i] = x[i*lanes + l];
+	  else
+	    for (int i=0; i<w; ++i)
+	      r[i] += x[i*lanes + l] * x[i*lanes + l];
+	}
+      }
+      if (k > 1)
+	for (long i=0; i<(_t1 - _t0) * w; ++i)
+	  _dst[i] = sqrtf(_dst[i] / k);
+    }
+  };
+  Recording& _rec;
+  const int _channel;
+  long _stride;
+  int _windowsPerSlice;
+  std::vector<float> _weights;
+  // First sample of a slice's j'th window.
+  long windowStart(const long t, const int j) const {
+    const long gap = _stride - vectorsize;
+    return t * _stride + (_windowsPerSlice > 1 ? j * gap / (_windowsPerSlice - 1) : 0);
+  }
+public:
+  WaveletExtractor(Recording& rec, const int channel) : _rec(rec), _channel(channel) {
+    const int w = waveletWindow;
+    if (w < 4 || (w & (w-1)) != 0 || w > int(CQuartet_widthMax))
+      quit("waveletwindow " + to_str(w) + " isn't a power of two from 4 to " + to_str(CQuartet_widthMax));
+    vectorsize = w;
+    const double sr = rec.rate(channel);
+    _stride = waveletStride > 0 ? waveletStride : std::max(1L, long(sampPeriodF / 1e7 * sr));
+    period = double(_stride) / sr;
+    _windowsPerSlice = _stride > w ? int((_stride + w - 1) / w) : 1;
+    _weights.resize(w);
+    for (int i=0; i<w; ++i)
+      _weights[i] = float(0.54 - 0.46 * cos(2.0*M_PI*i / (w-1.0)));
+    // A slice spans its stride or its window, whichever is longer, and must end before the recording does.
+    const long span = std::max(_stride, long(w));
+    const long csamp = rec.csamp(channel);
+    slices = csamp >= span ? (csamp - span) / _stride + 1 : 0;
+    setShard(span);
+  }
+  Task* shard(long t0, long t1, float* dst) const { return new Shard(*this, t0, t1, dst); }
+  std::string params() const { return "wavelet " + to_str(_stride) + " " + to_str(_rec.rate(_channel)) + " " + to_str(_channel); }
+};
+
+// Draw the waveform into a texture, like a traditional audio editor's.
+class WaveformExtractor : public Extractor {
+  class Shard : public Task {
+    const WaveformExtractor& _x;
+    const long _t0, _t1;
+    float* const _dst;
+
+    template <class T> const T& min3(const T& a, const T& b, const T& c) const { return std::min(a, std::min(b, c)); }
+    template <class T> const T& max3(const T& a, const T& b, const T& c) const { return std::max(a, std::max(b, c)); }
+    template <class T> const T avg(const T& a, const T& b) const { return (a+b)*0.5; }
+    template <class T> const T clamp(const T& tMin, const T& t, const T& tMax) const { return std::min(std::max(tMin, t), tMax); }
+
+    // Samples [s0, s1) of a channel.
+    struct Block {
+      const short* ps;
+      long s0, s1;
+    };
+
+    inline void minmaxFromWav(double& zMin, double& zMax, const Block& b, long tMin, long tMax) const {
+      tMin = clamp(b.s0, tMin-1, b.s1);
+      tMax = clamp(b.s0, tMax+1, b.s1);
+      const short* ps = b.ps - b.s0;
+      zMin = *std::min_element(ps+tMin, ps+tMax) / 65536.0 + 0.5;
+      zMax = *std::max_element(ps+tMin, ps+tMax) / 65536.0 + 0.5;
+      // C++11 std::minmax_element might be slightly faster, but tMax-tMin is usually tiny.
+    }
+
+    inline double sampleFromWav(const Block& b, const long t) const { // return 0.0 to 1.0
+      return b.ps[clamp(b.s0, t, b.s1-1) - b.s0] / 65536.0 + 0.5;
+    }
+
+  public:
+    Shard(const WaveformExtractor& x, long t0, long t1, float* dst) : _x(x), _t0(t0), _t1(t1), _dst(dst) {}
+    void work() const {
+      const double undersample = _x._undersample;
+      const int vectorsize = _x.vectorsize;
+      const long slices = _x.slices;
+      // One more sample on either side.
+      const long csamp = _x._rec.csamp(_x._channel);
+      const long s0 = clamp(0L, long(_t0*undersample) - 1, csamp);
+      const long s1 = clamp(0L, long(_t1*undersample) + 1, csamp);
+      std::vector<short> samples(s1 - s0);
+      _x._rec.read(_x._channel, s0, s1 - s0, &samples[0]);
+      const Block b = { &samples[0], s0, s1 };
+      std::fill(_dst, _dst + (_t1 - _t0) * vectorsize, 0.0f); // The background behind the waveform-line foreground.
+
+      // Test pattern.  t is horizontal.  s is vertical.
+      for (long t=_t0; t < _t1; ++t) {
+	double wavMin, wavMax;
+	if (undersample == 1.0) {
+	  // When sampleFromWav() is steep, to fill in gaps in the curve,
+	  // set to 1.0 not just the texel for sampleFromWav(t),
+	  // but also texels above and below that (in the s dimension),
+	  // over the full span of { wav, avg(wav,wavPrev), avg(wav,wavNext) }.
+	  //
+	  // (Can't anti-alias conventionally, because shader's palette has only one value reserved for the waveform, 1.0 i.e. 127.)
+	  //
+	  // (Gaps still happen when vertically zoomed out, suppressing some rows of texels.  Avoiding that demands a 2D texturemap
+	  // instead of 1D.  But that would vertically smear the spectrogram behind the waveform.  Pick one defect or the other.
+	  // What's worse, gaps in curve or smeared spectrogram values?)
+	  const double wav = sampleFromWav(b, long(t*undersample));
+	  const double wavPrev = sampleFromWav(b, std::max(t-1, 0L));
+	  const double wavNext = sampleFromWav(b, std::min(t+1, slices-1));
+	  wavMin = min3(avg(wav, wavPrev), wav, avg(wav, wavNext));
+	  wavMax = max3(avg(wav, wavPrev), wav, avg(wav, wavNext));
+	} else {
+	  // Keep the curve continuous by going one sample too far in each direction (the -1 and +1 in minmaxFromWav)
+	  minmaxFromWav(wavMin, wavMax, b, long(t*undersample), long((t+1)*undersample));
+	}
+	const int sWavMin = clamp(0, int(round(wavMin*vectorsize)), vectorsize-1);
+	const int sWavMax = clamp(0, int(round(wavMax*vectorsize)), vectorsize-1);
+
+	float* pz = _dst + (t - _t0) * vectorsize;
+	std::fill(pz+sWavMin, pz+sWavMax+1, 1.0f);
+      }
+    }
+  };
+  Recording& _rec;
+  const int _channel;
+  double _undersample;
+public:
+  WaveformExtractor(Recording& rec, const int channel) : _rec(rec), _channel(channel) {
+    vectorsize = 50; // number of vertical texels, at most 40 to 50
     const double msec_resolution = 5.3; // 0.3 is useful, 10.0 computes mipmaps way faster during development
-    const double undersample = std::max(msec_resolution*1e-3 * SR, 1.0);
-
-    m_period = undersample/SR; // waveform's sample rate
-    const int slices = int(wavcsamp/undersample);
-    m_cz = slices*m_vectorsize;
-    m_data = new float[m_cz](); // () means "value initialization" to all zeros, the background behind the waveform-line foreground.
-    // Test pattern.  t is horizontal.  s is vertical.
-    for (int t=0; t < slices; ++t) {
-      double wavMin, wavMax;
-      if (undersample == 1.0) {
-	// When sampleFromWav() is steep, to fill in gaps in the curve,
-	// set to 1.0 not just the texel for sampleFromWav(t),
-	// but also texels above and below that (in the s dimension),
-	// over the full span of { wav, avg(wav,wavPrev), avg(wav,wavNext) }.
-	//
-	// (Can't anti-alias conventionally, because shader's palette has only one value reserved for the waveform, 1.0 i.e. 127.)
-	//
-	// (Gaps still happen when vertically zoomed out, suppressing some rows of texels.  Avoiding that demands a 2D texturemap
-	// instead of 1D.  But that would vertically smear the spectrogram behind the waveform.  Pick one defect or the other.
-	// What's worse, gaps in curve or smeared spectrogram values?)
-	const double wav = sampleFromWav(channel, long(t*undersample));
-	const double wavPrev = sampleFromWav(channel, std::max(t-1, 0));
-	const double wavNext = sampleFromWav(channel, std::min(t+1, slices-1));
-	wavMin = min3(avg(wav, wavPrev), wav, avg(wav, wavNext));
-	wavMax = max3(avg(wav, wavPrev), wav, avg(wav, wavNext));
-      } else {
-	// Keep the curve continuous by going one sample too far in each direction (the -1 and +1 in minmaxFromWav)
-	minmaxFromWav(wavMin, wavMax, channel, long(t*undersample), long((t+1)*undersample));
+    const double sr = rec.rate(channel);
+    _undersample = std::max(msec_resolution*1e-3 * sr, 1.0);
+    period = _undersample/sr; // waveform's sample rate
+    slices = long(rec.csamp(channel)/_undersample);
+    fNormalize = false;
+    setShard(long(ceil(_undersample)));
+  }
+  Task* shard(long t0, long t1, float* dst) const { return new Shard(*this, t0, t1, dst); }
+  std::string params() const { return "waveform " + to_str(_undersample) + " " + to_str(_rec.rate(_channel)) + " " + to_str(_channel); }
+};
+
+// A prebuilt HTK feature file, www.ee.columbia.edu/ln/LabROSA/doc/HTKBook21/node58.html .
+class HtkExtractor : public Extractor {
+  // Byte-swap big-endian floats to dst, and if stats, accumulate them in the same pass.
+  // Shifts and masks instead of ntohl(), so the compiler vectorizes it.
+  class Shard : public Task {
+    const unsigned* const _src;
+    const long _cz;
+    const int _vectorsize;
+    float* const _dst;
+    VectorStats* const _stats;
+  public:
+    Shard(const unsigned* src, long cz, int vectorsize, float* dst, VectorStats* stats) :
+      _src(src), _cz(cz), _vectorsize(vectorsize), _dst(dst), _stats(stats) {}
+    static float swapped(const unsigned w) {
+      const unsigned u = (w >> 24) | ((w >> 8) & 0xff00) | ((w << 8) & 0xff0000) | (w << 24);
+      float z;
+      memcpy(&z, &u, sizeof(z));
+      return z;
+    }
+    void work() const {
+      if (!_stats) {
+	for (long i=0; i<_cz; ++i)
+	  _dst[i] = swapped(_src[i]);
+	return;
       }
-      const int sWavMin = clamp(0, int(round(wavMin*m_vectorsize)), m_vectorsize-1);
-      const int sWavMax = clamp(0, int(round(wavMax*m_vectorsize)), m_vectorsize-1);
+      float* __restrict lo = &_stats->zMin[0];
+      float* __restrict hi = &_stats->zMax[0];
+      double* __restrict sum = &_stats->zSum[0];
+      for (long i=0; i<_cz; i+=_vectorsize) {
+	const unsigned* __restrict src = _src + i;
+	float* __restrict dst = _dst + i;
+	for (int c=0; c<_vectorsize; ++c) {
+	  const float z = swapped(src[c]);
+	  dst[c] = z;
+	  lo[c] = std::min(lo[c], z);
+	  hi[c] = std::max(hi[c], z);
+	  sum[c] += z;
+	}
+      }
+    }
+  };
+  const std::string _filename;
+  const Mmap _htk;
+  const unsigned* _pw; // big-endian floats
+public:
+  HtkExtractor(const std::string& filename) : _filename(filename), _htk(filename, false) {
+    readHTK(filename, _htk, period, vectorsize, slices);
+    _pw = (const unsigned*)(_htk.pch() + 12);
+    fInvert = filename.find("fb") != std::string::npos;
+    setShard(0);
+  }
+  Task* shard(long t0, long t1, float* dst) const { return new Shard(_pw + t0*vectorsize, (t1-t0)*vectorsize, vectorsize, dst, NULL); }
+  Task* shardStats(long t0, long t1, float* dst, VectorStats& stats) const { return new Shard(_pw + t0*vectorsize, (t1-t0)*vectorsize, vectorsize, dst, &stats); }
+  std::string params() const { return "htk " + fileIdentity(_filename); }
+};
+
+// Which Extractor computes the kind of feature that a config file's line starts with.
+Extractor* extractor(Recording& rec, const int channel, const int iColormap, const std::string& filename)
+{
+  if (iColormap < 3)
+    return new FrontendExtractor(rec, channel, iColormap);
+  if (iColormap == 3)
+    return new WaveletExtractor(rec, channel);
+  return new HtkExtractor(filename);
+}
+
+// All levels of one chunk of mipmaps, as timeliner_run's CHello::getbatchByte() makes them, but without a CHello.
+// A texel summarizes every leaf (subsample slices) that overlaps it, as CHello::recurse() does.
+// So each level keeps, between each pair of adjacent half-texel boundaries, a summary of the leaves there.
+// Level 0's come from the feature's mmapped marshal file, read once, and each coarser level's merge the finer's.
+// So it holds just two of the chunk's levels, however long the recording is.
+class MipmapChunk : public Task {
+  const float* const _pz;	// the feature, _slices vectors
+  const long _slices;
+  const MipmapHeader& _h;
+  const double _hz;		// slices per second
+  const int _iColormap;
+  const int _ichunk;
+  unsigned char* const _dst;	// cbLevels(_h) bytes
+
+  // Boundaries every half texel, the m'th at t0 + m*dt/2, from m0 <= -1 to 2*width - 1.
+  // Texel i spans boundaries 2i-1 to 2i+1, the first of those a leftward neighbor's.
+  struct Level {
+    long m0;
+    std::vector<long> a, b;	// per boundary, cuts()
+    std::vector<long> pos;	// every a and b, sorted and unique
+    std::vector<float> spans;	// per [pos[q], pos[q+1]) of leaves, a column
+  };
+
+  // A column is numels, then vectorsize * { min, mean, max }, like a CQuartet.
+  int columnSize() const { return 1 + 3*_h.vectorsize; }
+
+  // Where leaf k starts, exactly as CHello's TFromIleaf(k*sub).  It ends where leaf k+1 starts.
+  double tLeaf(const long k) const { return (double(k * _h.subsample) - 0.5) / _hz; }
+
+  // The first leaf that a texel starting at s overlaps, and one past the last leaf that a texel ending at t overlaps.
+  // Estimated, then settled with CHello::recurse()'s own comparisons, because texel edges can coincide with leaves'.
+  void cuts(const double s, const double t, long& a, long& b) const {
+    const long cLeaves = _slices / _h.subsample;
+    a = std::min(cLeaves, std::max(0L, long(ceil((s*_hz + 0.5) / _h.subsample - 1.0))));
+    while (a > 0 && !(tLeaf(a) < s))
+      --a;
+    while (a < cLeaves && tLeaf(a+1) < s)
+      ++a;
+    b = std::min(cLeaves, std::max(0L, long(floor((t*_hz + 0.5) / _h.subsample)) + 1));
+    while (b < cLeaves && !(t < tLeaf(b)))
+      ++b;
+    while (b > 0 && t < tLeaf(b-1))
+      --b;
+  }
 
-      float* pz = m_data+t*m_vectorsize;
-      std::fill(pz+sWavMin, pz+sWavMax+1, 1.0f);
+  // Summarize leaves [k0, k1), each clamped to 0..1 as CQuartet clamps a leaf.
+  void summarize(const long k0, const long k1, float* col, double* sum) const {
+    const int w = _h.vectorsize;
+    for (int j=0; j<w; ++j) {
+      col[1+3*j] = 1.0f;
+      col[3+3*j] = 0.0f;
+      sum[j] = 0.0;
     }
+    const long c = (k1-k0) * _h.subsample;
+    const float* pz = _pz + k0 * _h.subsample * w;
+    for (long i=0; i<c; ++i) {
+      for (int j=0; j<w; ++j, ++pz) {
+	const float z = std::max(0.0f, std::min(1.0f, *pz));
+	col[1+3*j] = std::min(col[1+3*j], z);
+	sum[j] += z;
+	col[3+3*j] = std::max(col[3+3*j], z);
+      }
+    }
+    col[0] = float(c);
+    for (int j=0; j<w; ++j)
+      col[2+3*j] = float(sum[j] / c);
+  }
 
+  // Fold src into dst, like CHello's merge_for_recurse().  Numels 0 is nothing.
+  void merge(float* dst, const float* src) const {
+    const int w = _h.vectorsize;
+    if (dst[0] == 0.0f) {
+      std::copy(src, src + columnSize(), dst);
+      return;
+    }
+    const double n = double(dst[0]) + src[0];
+    for (int j=0; j<w; ++j) {
+      dst[1+3*j] = std::min(dst[1+3*j], src[1+3*j]);
+      dst[2+3*j] = float((dst[0]*double(dst[2+3*j]) + src[0]*double(src[2+3*j])) / n);
+      dst[3+3*j] = std::max(dst[3+3*j], src[3+3*j]);
+    }
+    dst[0] = float(n);
   }
 
-  inline void minmaxFromWav(double& zMin, double& zMax, const int channel, long tMin, long tMax) const {
-    tMin = clamp(0L, tMin-1, wavcsamp);
-    tMax = clamp(0L, tMax+1, wavcsamp);
-    const short* ps = rawS16[channel];
-    zMin = *std::min_element(ps+tMin, ps+tMax) / 65536.0 + 0.5;
-    zMax = *std::max_element(ps+tMin, ps+tMax) / 65536.0 + 0.5;
-    // C++11 std::minmax_element might be slightly faster, but tMax-tMin is usually tiny.
+  // Sort and dedup the cuts into l.pos, and size l.spans to match.
+  void positions(Level& l) const {
+    l.pos = l.a;
+    l.pos.insert(l.pos.end(), l.b.begin(), l.b.end());
+    std::sort(l.pos.begin(), l.pos.end());
+    l.pos.erase(std::unique(l.pos.begin(), l.pos.end()), l.pos.end());
+    l.spans.assign((l.pos.size() - 1) * columnSize(), 0.0f);
   }
 
-  inline double sampleFromWav(const int channel, const long t) const { // return 0.0 to 1.0
-    return rawS16[channel][clamp(0L, t, wavcsamp)] / 65536.0 + 0.5;
+public:
+  MipmapChunk(const float* pz, long slices, const MipmapHeader& h, double hz, int iColormap, int ichunk, unsigned char* dst) :
+    _pz(pz), _slices(slices), _h(h), _hz(hz), _iColormap(iColormap), _ichunk(ichunk), _dst(dst) {}
+
+  // Bytes of all of a chunk's levels.
+  static long cbLevels(const MipmapHeader& h) { return h.offset(h.levels(), 0) / h.cchunk; }
+  // Bytes that work() holds, besides its cbLevels() of output.
+  // Level 0 has 3*widthChunk(0) boundaries, and at most a span per leaf, of which 1.5 chunks have about that many.
+  // Level 1 has half of each.
+  static long cbWork(const MipmapHeader& h) {
+    const long cColumn = 9L * h.widthChunk(0) / 4 + 8;
+    const long cCut = 3L * 3 * 3 * h.widthChunk(0) / 2;
+    return cColumn * (1 + 3*h.vectorsize) * sizeof(float) + cCut * sizeof(long) + long(h.vectorsize) * h.widthChunk(0);
   }
 
-  void validate() const
+  void work() const {
+    const int w = _h.vectorsize;
+    const int cz = columnSize();
+    const double t0 = lerp(_ichunk     / double(_h.cchunk), _h.tBound[0], _h.tBound[1]);
+    const double t1 = lerp((_ichunk+1) / double(_h.cchunk), _h.tBound[0], _h.tBound[1]);
+    int width = _h.widthChunk(0);
+    double dt = (t1-t0) / width;
+
+    // Level 0 reaches left as far as the coarsest texel, half a chunk.
+    Level fine, coarse;
+    fine.m0 = -width;
+    const long cm = 3*width;
+    fine.a.resize(cm);
+    fine.b.resize(cm);
+    for (long m=0; m<cm; ++m) {
+      const double x = t0 + (fine.m0 + m) * 0.5*dt;
+      cuts(x, x, fine.a[m], fine.b[m]);
+    }
+    // Level 0's texel edges, as getbatchByte() computes them.
+    double t = t0;
+    for (int i=0; i<width; ++i, t+=dt) {
+      long _;
+      cuts(Float(t - 0.5*dt), 0.0, fine.a[2*i-1 - fine.m0], _);
+      cuts(0.0, Float(t + 0.5*dt), _, fine.b[2*i+1 - fine.m0]);
+    }
+    positions(fine);
+    std::vector<double> sum(w);
+    for (size_t q=0; q+1<fine.pos.size(); ++q)
+      summarize(fine.pos[q], fine.pos[q+1], &fine.spans[q*cz], &sum[0]);
+
+    std::vector<unsigned char> bufByte(w * width);
+    std::vector<float> col(cz);
+    unsigned char* dst = _dst;
+    for (int level=0; level<_h.levels(); dst += _h.chunkBytes(level++)) {
+      if (level > 0) {
+	// Every other boundary, so every cut is already one of fine's.
+	width /= 2;
+	coarse.m0 = fine.m0 / 2;
+	const long cm = 2*width - coarse.m0;
+	coarse.a.resize(cm);
+	coarse.b.resize(cm);
+	for (long m=0; m<cm; ++m) {
+	  coarse.a[m] = fine.a[2*(coarse.m0 + m) - fine.m0];
+	  coarse.b[m] = fine.b[2*(coarse.m0 + m) - fine.m0];
+	}
+	positions(coarse);
+	size_t r = std::lower_bound(fine.pos.begin(), fine.pos.end(), coarse.pos[0]) - fine.pos.begin();
+	for (size_t q=0; q+1<coarse.pos.size(); ++q)
+	  for (; fine.pos[r] < coarse.pos[q+1]; ++r)
+	    merge(&coarse.spans[q*cz], &fine.spans[r*cz]);
+	std::swap(fine, coarse);
+      }
+      // As getbatchByte() does, with CQuartet::dummy()'s value where no leaves are.
+      for (int i=0; i<width; ++i) {
+	const long a = fine.a[2*i-1 - fine.m0];
+	const long b = fine.b[2*i+1 - fine.m0];
+	col[0] = 0.0f;
+	for (size_t q = std::lower_bound(fine.pos.begin(), fine.pos.end(), a) - fine.pos.begin(); fine.pos[q] < b; ++q)
+	  merge(&col[0], &fine.spans[q*cz]);
+	for (int j=0; j<w; ++j) {
+	  const bool f = col[0] > 0.0f;
+	  const Float mmm[3] = { f ? col[1+3*j] : 0.5, f ? col[2+3*j] : 0.5, f ? col[3+3*j] : 0.5 };
+	  bufByte[j*width + i] = (unsigned char)(ByteFromMMM(mmm, _iColormap) * 255.0);
+	}
+      }
+      if (_h.format == MipmapHeader::formatBC4)
+	bc4Encode(&bufByte[0], width, w, dst);
+      else
+	std::copy(bufByte.begin(), bufByte.begin() + w*width, dst);
+    }
+  }
+};
+
+// Mipmaps that timeliner_run would otherwise compute at every launch, for a feature of cz floats.
+MipmapHeader mipmapHeader(const long cz, const int vectorsize, const int iColormap, const double tEnd)
+{
+  // Most GPUs' GL_MAX_TEXTURE_SIZE is at least this.
+  // timeliner_run recomputes the mipmaps itself if its GPU's is smaller.
+  const unsigned widthLim = 4096;
+
+  MipmapHeader h;
+  memcpy(h.magic, MipmapHeader::magicCur(), sizeof(h.magic));
+  h.version = MipmapHeader::versionCur;
+  h.subsample = mipmapSubsample();
+  h.width = mipmapWidth(int(cz / vectorsize), h.subsample);
+  h.cchunk = mipmapChunks(h.width, widthLim);
+  h.vectorsize = vectorsize;
+  h.iColormap = iColormap;
+  h.format = mipmapCompress() ? MipmapHeader::formatBC4 : MipmapHeader::formatBytes;
+  h.tBound[0] = 0.0;
+  h.tBound[1] = tEnd;
+  return h;
+}
+
+// Bytes that Feature::mipmapdump() holds at once, with at most cInFlight chunks in flight.
+// Independent of the recording's length.
+long cbMipmapdump(const MipmapHeader& h, const int cInFlight)
+{
+  return std::min(h.cchunk, cInFlight) * (MipmapChunk::cbLevels(h) + MipmapChunk::cbWork(h));
+}
+
+class Feature {
+  const int m_iColormap;
+  const std::string m_name;
+  const std::string m_filename; // marshal file
+  double m_period;
+  int m_vectorsize;
+  long m_cz;
+
+public:
+  // Compute the feature, and write it to the marshal file fileOut.
+  // Its shards run in parallel, at most a few more than there are workers, and are appended in order.
+  Feature(WorkerPool& pool, const Extractor& x, const int iColormap, const std::string& caption, const std::string& fileOut) :
+    m_iColormap(iColormap),
+    m_name(caption),
+    m_filename(fileOut),
+    m_period(x.period),
+    m_vectorsize(x.vectorsize),
+    m_cz(x.cz())
   {
-#ifndef NDEBUG
-#ifndef _MSC_VER
-	  // VS2013 only got std::isnormal and std::fpclassify in July 2013:
-	  // http://blogs.msdn.com/b/vcblog/archive/2013/07/19/c99-library-support-in-visual-studio-2013.aspx
-    for (size_t i=0; i<m_cz; ++i) {
-      if (!std::isnormal(m_data[i]) && m_data[i] != 0.0) {
-	printf("Feature's float %lu of %lu is bogus: class %d, value %f\n", i, m_cz, std::fpclassify(m_data[i]), m_data[i]);
-	quit("");
+    if (x.slices <= 0)
+      quit("recording too short for even one slice of " + caption);
+    MarshalFile out(fileOut, caption, iColormap);
+    out.begin(x.period, x.vectorsize);
+    const long cShard = x.shards();
+    const long cInFlight = std::min(cShard, long(shardsInFlight(pool)));
+    std::vector<std::vector<float> > bufs(cInFlight, std::vector<float>(x.slicesPerShard * x.vectorsize));
+    std::vector<VectorStats> stats(cInFlight);
+    TaskHandles handles(cInFlight);
+    for (long i=0; i<cShard + cInFlight; ++i) {
+      const long slot = i % cInFlight;
+      if (i >= cInFlight) {
+	// Append the shard that was submitted cInFlight ago.
+	const long j = i - cInFlight;
+	pool.wait(handles[slot]);
+	out.append(&bufs[slot][0], (std::min(x.slices, (j+1) * x.slicesPerShard) - j * x.slicesPerShard) * x.vectorsize, stats[slot]);
+      }
+      if (i < cShard) {
+	const long t0 = i * x.slicesPerShard;
+	const long t1 = std::min(x.slices, t0 + x.slicesPerShard);
+	stats[slot].reset(x.vectorsize);
+	handles[slot] = pool.task(x.shardStats(t0, t1, &bufs[slot][0], stats[slot]));
       }
     }
-#endif
-#endif
+    info(to_str(x.slices) + " slices, " + to_str(x.vectorsize) + " floats/slice, of " + caption);
+    out.finish(caption, x.cZeroMean, x.fNormalize, x.fInvert);
   }
 
-  // Caller must delete[] pb and pz.
-  void binarydump(char*& pb, long& cb, float*& pz, long& cz)
+  static int shardsInFlight(const WorkerPool& pool) { return pool.workers() + 2; }
+
+  // Precompute the mipmaps that timeliner_run would otherwise compute at every launch.
+  // Whoever submitted this has admitted cbMipmapdump() bytes.
+  void mipmapdump(const std::string& filename, const double tEnd, WorkerPool& pool) const
   {
-    if (!m_data || m_cz==0)
+    // Read the feature back from its marshal file, like timeliner_run's binaryload(), so it needn't stay in memory.
+    const Mmap marshaled(m_filename, false);
+    const MarshalHeader* hm = (const MarshalHeader*)marshaled.pch();
+    if (!marshaled.valid() || !hm->valid(marshaled.cch()))
       quit("no data for feature '" + m_name + "'");
+    const float* pz = (const float*)(marshaled.pch() + hm->offData);
+
+    const MipmapHeader h = mipmapHeader(m_cz, m_vectorsize, m_iColormap, tEnd);
+    std::ofstream t(filename.c_str(), std::ios_base::binary | std::ios_base::out);
+    t.write((const char*)&h, sizeof(h));
+    // A few chunks in parallel, each writing all its levels once it and those left of it are done.
+    const int cInFlight = std::min(h.cchunk, shardsInFlight(pool));
+    std::vector<std::vector<unsigned char> > bufs(cInFlight, std::vector<unsigned char>(MipmapChunk::cbLevels(h)));
+    TaskHandles handles(cInFlight);
+    for (int i=0; i<h.cchunk + cInFlight; ++i) {
+      const int slot = i % cInFlight;
+      if (i >= cInFlight) {
+	const int ichunk = i - cInFlight;
+	pool.wait(handles[slot]);
+	const unsigned char* pb = &bufs[slot][0];
+	for (int level=0; level<h.levels(); pb += h.chunkBytes(level++)) {
+	  t.seekp(sizeof(h) + h.offset(level, ichunk));
+	  t.write((const char*)pb, h.chunkBytes(level));
+	}
+      }
+      if (i < h.cchunk) {
+	// Float period, exactly as timeliner_run's makeCache() uses it, so the texels match its CHello's.
+	handles[slot] = pool.task(new MipmapChunk(pz, m_cz / m_vectorsize, h, 1.0f/float(m_period), m_iColormap, i, &bufs[slot][0]));
+      }
+    }
+    if (!t.good())
+      warn("failed to write mipmaps " + filename);
+  }
+};
 
-	cb = m_name.size();
-    pb = new char[cb+1];
-    (void)std::copy(m_name.begin(), m_name.end(), pb);
-	pb[cb] = '\0';
+// One feature of one channel:  compute it, then its mipmaps.
+// Independent of other features and channels, so they all run in parallel, as memory permits.
+class BuildFeature : public Task {
+  WorkerPool& _pool;
+  const Extractor* const _x;
+  const int _iColormap;
+  const std::string _caption;
+  const std::string _fileOut;
+  const double _tEnd;
+  const long _cb; // admitted by whoever submitted this
+public:
+  BuildFeature(WorkerPool& pool, const Extractor* x, int iColormap, const std::string& caption, const std::string& fileOut, double tEnd, long cb) :
+    _pool(pool), _x(x), _iColormap(iColormap), _caption(caption), _fileOut(fileOut), _tEnd(tEnd), _cb(cb) {}
+  ~BuildFeature() { delete _x; }
+  void work() const {
+    const Feature feat(_pool, *_x, _iColormap, _caption, _fileOut);
+    feat.mipmapdump(_fileOut + ".mip", _tEnd, _pool);
+    _pool.release(_cb);
+  }
+  void abandon() const { _pool.release(_cb); }
 
-    cz = 4 + m_cz;
-    pz = new float[cz];
-    pz[0] = float(m_iColormap);
-    pz[1] = float(m_period);
-    pz[2] = float(m_cz) / m_vectorsize;
-    pz[3] = float(m_vectorsize);
-    std::copy(m_data, m_data+m_cz, pz+4);
+  // Bytes that work() holds at once, about.
+  static long cbWork(const WorkerPool& pool, const Extractor& x, int iColormap, double tEnd) {
+    return Feature::shardsInFlight(pool) * std::max(cbShard, long(x.slicesPerShard * x.vectorsize * sizeof(float))) +
+      cbMipmapdump(mipmapHeader(x.cz(), x.vectorsize, iColormap, tEnd), Feature::shardsInFlight(pool));
   }
 };
 
-void marshal(const char* filename, Feature feat) {
-  char* rgb; long cb; float* rgz; long cz;
-  feat.binarydump(rgb, cb, rgz, cz);
-  fileFromBufs(filename, rgb, cb, rgz, cz);
-  delete [] rgb;
-  delete [] rgz;
-  // Worth making a class of rgb, cb, rgz, cz?  Then destructor could delete[] rgb and rgz.
-}
-
 #ifndef _MSC_VER
 bool CopyFile(const char* filenameSrc, const char* filenameDst)
 {
 #if 1
-  // Until mixed.wav can be converted from other formats.
+  // mixed.wav is the recording itself, when that's already in mixedformat.
   // Fully qualify path of filenameSrc, if needed.
   const std::string src = filenameSrc[0] == '/' ? filenameSrc : get_current_dir_name() + std::string("/") + filenameSrc ;
   // std::cout << "Making symlink from " << src << " to  " << filenameDst << "\n";
@@ -530,9 +1347,179 @@ inline std::string& trimTrailingComment(std::string &s) {
 bool removeable(const std::string& s) { return s.empty() || s[0] == '#'; }
 bool keyvalue(const std::string& s) { return s.find('=') != s.npos; } // lazy shortcut
 
+// Once its memory fits, start building a feature.
+void submitFeature(WorkerPool& pool, const Extractor* x, const int iColormap, const std::string& caption, const std::string& fileOut, const double tEnd)
+{
+  const long cb = BuildFeature::cbWork(pool, *x, iColormap, tEnd);
+  pool.admit(cb);
+  (void)pool.task(new BuildFeature(pool, x, iColormap, caption, fileOut, tEnd, cb));
+}
+
+// Whether an earlier run finished a marshal file and its mipmaps.
+// Each is written header last, or is checked against its header's length, so a valid one is complete.
+bool fBuilt(const std::string& filename)
+{
+  const Mmap marshaled(filename);
+  if (!marshaled.valid() || !((const MarshalHeader*)marshaled.pch())->valid(marshaled.cch()))
+    return false;
+  const Mmap mip(filename + ".mip");
+  if (!mip.valid() || mip.cch() < off_t(sizeof(MipmapHeader)))
+    return false;
+  const MipmapHeader& h = *(const MipmapHeader*)mip.pch();
+  return h.valid() && mip.cch() >= off_t(sizeof(MipmapHeader) + h.payload());
+}
+
+// List a feature in the manifest, and build it unless an earlier run or config line already did.
+// Its marshal file is named for a hash of everything it depends on, so a changed feature gets a new name.
+void addFeature(WorkerPool& pool, const Extractor* x, const std::string& source, const int chan,
+  const int iColormap, const std::string& caption, const double tEnd, std::vector<MarshalEntry>& manifest)
+{
+  std::ostringstream os;
+  os.precision(17);
+  os << source << "\n" << x->params() << "\n"
+     << x->period << " " << x->vectorsize << " " << x->slices << " " << x->cZeroMean << " " << x->fNormalize << " " << x->fInvert << "\n"
+     << iColormap << " " << caption << " " << tEnd << "\n"
+     << MarshalHeader::versionCur << " " << MipmapHeader::versionCur << " " << mipmapSubsample() << " " << mipmapCompress();
+  const MarshalEntry e = { "features" + hashHex(os.str()), chan, iColormap, caption };
+  bool fListed = false;
+  for (std::vector<MarshalEntry>::const_iterator it = manifest.begin(); it != manifest.end(); ++it)
+    fListed |= it->filename == e.filename;
+  manifest.push_back(e);
+  if (fListed || fBuilt(e.filename)) {
+    info("reusing " + e.filename + " for " + caption + " of channel " + to_str(chan));
+    delete x;
+    return;
+  }
+  submitFeature(pool, x, iColormap, caption, e.filename, tEnd);
+}
+
+// PowerSpectrum matches a direct DFT, and deltas() computed a shard at a time,
+// with deltaMargin() frames on either side as FrontendExtractor::Shard does, match one pass over everything.
+void testFrontend()
+{
+#ifndef NDEBUG
+  srand(1);
+  for (int n=4; n<=4096; n*=2) {
+    std::vector<float> x(n), power(n/2 + 1);
+    double energy = 0.0;
+    for (int i=0; i<n; ++i) {
+      x[i] = float(rand()) / RAND_MAX - 0.5f;
+      energy += x[i] * x[i];
+    }
+    PowerSpectrum spectrum(n);
+    spectrum(&x[0], &power[0]);
+    std::vector<double> c(n), s(n);
+    for (int i=0; i<n; ++i) {
+      c[i] = cos(2.0*M_PI*i / n);
+      s[i] = sin(2.0*M_PI*i / n);
+    }
+    for (int k=0; k<=n/2; ++k) {
+      double re = 0.0, im = 0.0;
+      for (int i=0; i<n; ++i) {
+	re += x[i] * c[long(k)*i % n];
+	im -= x[i] * s[long(k)*i % n];
+      }
+      if (fabs(power[k] - (re*re + im*im)) > 1e-5 * energy)
+	quit("PowerSpectrum of size " + to_str(n) + " is wrong at bin " + to_str(k));
+    }
+  }
+
+  const Frontend frontend(Frontend::kindFbankDeltas, 16000.0, numchans);
+  const int vectorsize = frontend.vectorsize();
+  const long margin = frontend.deltaMargin();
+  const long cFrame = 100;
+  std::vector<float> whole(cFrame * vectorsize);
+  for (long t=0; t<cFrame; ++t)
+    for (int c=0; c<frontend.statics(); ++c)
+      whole[t*vectorsize + c] = float(rand()) / RAND_MAX;
+  std::vector<float> sharded(whole);
+  frontend.deltas(&whole[0], cFrame);
+  const long cShard = 7; // Shorter than the margin on both sides, to test that too.
+  for (long t0=0; t0<cFrame; t0+=cShard) {
+    const long t1 = std::min(cFrame, t0 + cShard);
+    const long u0 = std::max(0L, t0 - margin);
+    const long u1 = std::min(cFrame, t1 + margin);
+    std::vector<float> vectors(sharded.begin() + u0*vectorsize, sharded.begin() + u1*vectorsize);
+    frontend.deltas(&vectors[0], u1 - u0);
+    for (long i=(t0-u0)*vectorsize; i<(t1-u0)*vectorsize; ++i)
+      if (fabs(vectors[i] - whole[u0*vectorsize + i]) > 1e-5f)
+	quit("deltas of frame " + to_str(u0 + i/vectorsize) + " depend on its shard");
+  }
+#endif
+}
+
+// Wavelet matches GSL's direct form, the centered D4 filters h and g applied level by level,
+// in every lane, for windows of 4 to 128 samples.
+void testWavelet()
+{
+#ifndef NDEBUG
+  const double r3 = sqrt(3.0), k = 1.0 / (4.0 * sqrt(2.0));
+  const double h[4] = { (1+r3)*k, (3+r3)*k, (3-r3)*k, (1-r3)*k };
+  const double g[4] = { h[3], -h[2], h[1], -h[0] };
+  const int lanes = Wavelet::lanes;
+  srand(1);
+  for (int n=4; n<=128; n*=2) {
+    std::vector<float> x(n * lanes);
+    for (size_t i=0; i<x.size(); ++i)
+      x[i] = float(rand()) / RAND_MAX - 0.5f;
+    std::vector<float> y(x);
+    Wavelet wavelet(n);
+    wavelet(&y[0]);
+    for (int l=0; l<lanes; ++l) {
+      std::vector<double> a(n), work(n);
+      for (int i=0; i<n; ++i)
+	a[i] = x[i*lanes + l];
+      for (int m=n; m>=2; m/=2) {
+	for (int i=0; i<m/2; ++i) {
+	  double s = 0.0, d = 0.0;
+	  for (int j=0; j<4; ++j) {
+	    const double z = a[(2*i - 2 + j + m) % m];
+	    s += h[j] * z;
+	    d += g[j] * z;
+	  }
+	  work[i] = s;
+	  work[m/2 + i] = d;
+	}
+	std::copy(work.begin(), work.begin() + m, a.begin());
+      }
+      for (int i=0; i<n; ++i)
+	if (fabs(y[i*lanes + l] - a[i]) > 1e-5 * n)
+	  quit("Wavelet of size " + to_str(n) + " is wrong at coefficient " + to_str(i) + " of lane " + to_str(l));
+    }
+  }
+#endif
+}
+
+// Files in the current directory whose names start with prefix.
+std::vector<std::string> filesStartingWith(const std::string& prefix)
+{
+  std::vector<std::string> names;
+#ifdef _MSC_VER
+  WIN32_FIND_DATAA fd;
+  const HANDLE h = FindFirstFileA((prefix + "*").c_str(), &fd);
+  if (h != INVALID_HANDLE_VALUE) {
+    do
+      names.push_back(fd.cFileName);
+    while (FindNextFileA(h, &fd));
+    FindClose(h);
+  }
+#else
+  DIR* dir = opendir(".");
+  if (!dir)
+    return names;
+  while (const dirent* e = readdir(dir))
+    if (!strncmp(e->d_name, prefix.c_str(), prefix.size()))
+      names.push_back(e->d_name);
+  closedir(dir);
+#endif
+  return names;
+}
+
 int mainCore(int argc, char** argv)
 {
   appname = argv[0];
+  testFrontend();
+  testWavelet();
   switch (argc) {
     case 3:
       configfile = argv[2];
@@ -592,6 +1579,17 @@ int mainCore(int argc, char** argv)
     else if (key == "numchans") {
       numchans = atoi(value.c_str());
     }
+    else if (key == "waveletwindow") {
+      waveletWindow = atoi(value.c_str());
+    }
+    else if (key == "waveletstride") {
+      waveletStride = atol(value.c_str());
+    }
+    else if (key == "mixedformat") {
+      formatMixed = mixedFormat(value);
+      if (formatMixed == 0)
+	quit("Config file " + configfile + ": mixedformat " + value + " isn't wav16, wav24, float, or flac");
+    }
     else
       warn("Config file " + configfile + ": key=value syntax: unrecognized key " + key);
   }
@@ -603,8 +1601,12 @@ int mainCore(int argc, char** argv)
     quit("failed to chdir to dir above marshal dir");
 
   const std::string suffix = wavSrc.substr(wavSrc.size()-3);
-  if (channels_fake < 0) channels_fake = channels;
-  if (suffix == "wav") {
+  const std::string mixedfile = dirMarshal + "/mixed.wav";
+  Recording* recording = NULL;
+  SNDFILE* pfMixed = NULL;	// If mixed.wav must be converted from the recording,
+  unsigned channelsMixed = 0;	// from this many of its channels.
+  if (suffix != "rec") {
+    // Any format that libsndfile reads, converted to 16-bit samples as it's read.
     // www.mega-nerd.com/libsndfile/api.html
     SF_INFO sfinfo;
     sfinfo.format = 0;
@@ -618,189 +1620,79 @@ int mainCore(int argc, char** argv)
       quit("no wav file " + wavSrc  + " in directory " + get_current_dir_name());
 #endif
     }
-    SR = sfinfo.samplerate;
     //printf("%ld frames, %d SR, %d channels, %x format, %d sections, %d seekable\n",
     //  long(sfinfo.frames), sfinfo.samplerate, sfinfo.channels, sfinfo.format, sfinfo.sections, sfinfo.seekable);
-
-    if (sfinfo.format != (SF_FORMAT_WAV | SF_FORMAT_PCM_16))
-      quit(wavSrc + " doesn't have format .wav PCM 16-bit.  Sorry.");
-    // todo: /usr/include/sndfile.h actually supports dozens of other file formats.  So allow those.
-    // todo: convert to 16-bit 16khz, before storing in wavS16.  Without calling system("sox ..."), so it works in win32.
-
-
-    // info("copying or symlinking " + wavSrc + " to " + dirMarshal + "/mixed.wav");
+    SF_FORMAT_INFO fi;
+    fi.format = sfinfo.format & SF_FORMAT_TYPEMASK;
+    const std::string major = sf_command(NULL, SFC_GET_FORMAT_INFO, &fi, sizeof(fi)) == 0 ? fi.name : to_str(fi.format);
+    fi.format = sfinfo.format & SF_FORMAT_SUBMASK;
+    const std::string minor = sf_command(NULL, SFC_GET_FORMAT_INFO, &fi, sizeof(fi)) == 0 ? fi.name : to_str(fi.format);
+    info(wavSrc + " is " + major + ", " + minor);
+    if (!sfinfo.seekable)
+      quit(wavSrc + " isn't seekable, so features can't read it a block at a time.  Sorry.");
+    // Floating-point samples beyond +-1 clip, instead of wrapping around.
+    (void)sf_command(pf, SFC_SET_CLIPPING, NULL, SF_TRUE);
+
+    // Read it only as features need it, a block at a time.
+    // Fully qualified, because it reopens the file for each concurrent reader, after chdir(dirMarshal).
+    recording = new SndfileRecording(wavSrc[0] == '/' ? wavSrc : getcwd(NULL, 0) + std::string("/") + wavSrc, pf, sfinfo);
+
+    if (sfinfo.format != formatMixed) {
+      // Convert it, on the pool, alongside the features.
+      channelsMixed = sfinfo.channels;
+      pfMixed = openMixed(mixedfile, sfinfo.samplerate, channelsMixed);
+    } else {
+      // info("copying or symlinking " + wavSrc + " to " + mixedfile);
 #ifdef too_slow_for_huge_files
-    {
-      std::ifstream src(wavSrc.c_str(), std::ios::binary);
-      std::ofstream dst((dirMarshal + "/mixed.wav").c_str(), std::ios::binary | std::ios_base::out);
-      dst << src.rdbuf();
-    }
+      {
+	std::ifstream src(wavSrc.c_str(), std::ios::binary);
+	std::ofstream dst(mixedfile.c_str(), std::ios::binary | std::ios_base::out);
+	dst << src.rdbuf();
+      }
 #else
 #ifdef _MSC_VER
-    (void)CopyFile(wavSrc.c_str(), (dirMarshal + "/mixed.wav").c_str(), false);
-    // if returns zero, call GetLastError().
+      (void)CopyFile(wavSrc.c_str(), mixedfile.c_str(), false);
+      // if returns zero, call GetLastError().
 #else
-    CopyFile(wavSrc.c_str(), (dirMarshal + "/mixed.wav").c_str());
-#endif
-#endif
-
-    info("reading " + wavSrc);
-    wavcsamp = long(sfinfo.frames);
-    channels = sfinfo.channels;
-    short* wavS16 = new short[wavcsamp * channels];
-    const long cs = long(sf_readf_short(pf, wavS16, wavcsamp));
-    if (cs != wavcsamp)
-      quit("failed to read " + wavSrc);
-    if (0 != sf_close(pf))
-      warn("failed to close " + wavSrc);
-    info("readed " + wavSrc);
-
-    rawS16 = new short*[channels];
-    if (channels == 1) {
-      rawS16[0] = wavS16;
-      // Cleverly, wavS16 gets delete[]'d eventually, as rawS16[0].
-    } else {
-      // De-interleave wavS16 into separate channels, 1 short at a time.
-      // This is http://en.wikipedia.org/wiki/In-place_matrix_transposition .
-      // Expensive and thrash-prone, thus better avoided by instead changing how memory is accessed.
-      info("de-interleaving channels");
-      for (unsigned i=0; i<channels; ++i) {
-	short* ps = new short[wavcsamp];
-	for (long j=0; j<wavcsamp; ++j)
-	  ps[j] = wavS16[j*channels + i];
-	rawS16[i] = ps;
-      }
-      info("de-interleaved channels");
-      delete [] wavS16;
-    }
-
-  } else if (suffix == "rec") {
-    // EDF (European Data Format, http://www.edfplus.info/specs/edf.html ) EEG recording.
-    // Also http://code.google.com/p/telehealth/source/browse/lifelink/rxbox/trunk/rxbox-rc1/Local_EDFviewer/edfviewer.py?r=559
-    const Mmap* foo = new Mmap(wavSrc); // might not need that pointer
-    const char* pch = foo->pch();
-    const off_t cch = foo->cch();
-    if (cch == 0)
-      quit("empty EDF file " + wavSrc);
-    if (cch < 256)
-      quit("truncated global header in EDF file " + wavSrc);
-    //info("parsing EDF header");
-    //info(std::string(pch, 256));
-
-#ifdef _MSC_VER
-#define strtof(a,b) strtol(a,b,10)
-#pragma message("warning: Visual Studio doesn't support C99's strtof().")
+      CopyFile(wavSrc.c_str(), mixedfile.c_str());
 #endif
-
-    // Lazily ignore strtol's errno: http://stackoverflow.com/questions/194465/how-to-parse-a-string-to-an-int-in-c
-    char* end;
-    const long bytesInHeader        = strtol(std::string(pch+184, 8).c_str(), &end, 10); // 24320.
-    long numRecords                 = strtol(std::string(pch+236, 8).c_str(), &end, 10);
-    const double secondsPerRecord   = strtof(std::string(pch+244, 8).c_str(), &end);
-    channels                        = strtol(std::string(pch+252, 4).c_str(), &end, 10);
-
-    if (bytesInHeader != 256 + channels*256)
-      quit("corrupt global header in EDF file " + wavSrc);
-    // fseek past bytesInHeader + 1*bytesPerRecord.
-    // for irec 1..nrec:
-    // read shorts, from samplesPerRecord to channels.
-    // save from   (irec-1)*samplesPerRecord+1   to   irec*samplesPerRecord
-
-    // const double hours = numRecords * secondsPerRecord / 3600.0;
-    // std::cerr << numRecords << " records, " << channels << " channels, " << secondsPerRecord << " sec/record, " << hours << " hours.\n";
-
-    if (cch < bytesInHeader)
-      quit("truncated per-channel header in EDF file " + wavSrc);
-    pch += 256;
-
-    pch += channels * (16+80+8+8+8+8+8+80); // For now, skip lbl trt pdq pmn pmx dmn dmx pft.
-    // Samples per data record.
-    // Rashly use only the first (326).   ;;;; Verify every "nsp"?
-    const int samplesPerRecord = strtol(std::string(pch, 8).c_str(), &end, 10); // "nsp" in Kyle's parser.  shortsPerChannelInARecord.
-
-    const double samplesPerSecond = samplesPerRecord / secondsPerRecord;
-    const long shortsPerRecord = samplesPerRecord * channels;
-    // const long bytesPerRecord = shortsPerRecord * 2; // "rsz" in Kyle's parser
-    // std::cerr << "sr is " << samplesPerSecond << ".\n" << bytesPerRecord << " bytesPerRecord.\n";
-    pch += channels * (8+32); // Skip "nsp".  Now pch points at the signed 16-bit data.
-
-    info("parsing EDF body: creating .wav file");
-    // off_t expectedEOF = bytesPerRecord * numRecords;
-    // assert(pch - foo->pch() + expectedEOF == cch);
-    // const off_t cs = expectedEOF/2;
-    const short* ps = (const short*)pch; // yeah, yeah, pointer aliasing, shaddap already
-
-    // std::cerr << "header was " << pch-foo->pch() << " bytes, body should be " << bytesPerRecord * numRecords << " bytes, cch is " << cch << "\n";
-
-    // The specification says:
-    //   Each data record contains 'duration' seconds of 'ns' signals.
-    //   Each signal is represented by the header-specified number of samples.
-    // In other words:
-    //   After the header comes a sequence of blocks.
-    //   Each block is a concatenation of "channels" sequences of shorts.
-
-    wavcsamp = numRecords * samplesPerRecord;
-    numRecords /= 1000; info("debug: reading a fraction of the data");
-    wavcsamp_fake = numRecords * samplesPerRecord;
-
-    channels_fake = 9; // channels;
-    short* wavsamples = new short[wavcsamp_fake * channels_fake];
-
-    // Interleave samples, from within each Record, into wavsamples[].
-    for (long irecord=0; irecord<numRecords; ++irecord) {
-      if (irecord % 20 == 0) printf("Record %6ld of %6ld expects %ld shorts as %u sequences of %d.\n", irecord, numRecords, shortsPerRecord, channels, samplesPerRecord);
-      const short* psRecord = ps + irecord*shortsPerRecord;
-      for (int chan = 0; chan < channels_fake; ++chan)
-	std::copy(
-	  psRecord + chan*wavcsamp,
-	  psRecord + chan*wavcsamp + samplesPerRecord,
-	  wavsamples + chan*wavcsamp_fake + irecord*samplesPerRecord);
-    }
-
-    // timeliner_run *playing* 3- or 20- or 94-channel audio is silly.
-    // Must example/stereo/marshal/mixed.wav be 94-channel?
-    // Can timeliner_pre *somehow* marshal 94 mipmaps and a merely mono mixed.mp3?
-    // Build autoscaling into the mipmap?
-    // Combine wav drawn on spectrogram into a single mipmap?
-
-    //;;;; do this for win32 too, *constructing* mixed.wav.
-    const std::string mixedfile = dirMarshal + "/mixed.wav";
-    SF_INFO sfinfo;
-    sfinfo.samplerate = SR = int(samplesPerSecond);
-    sfinfo.channels = channels_fake;
-    sfinfo.format = SF_FORMAT_WAV|SF_FORMAT_PCM_16;
-    SNDFILE* pf = sf_open(mixedfile.c_str(), SFM_WRITE, &sfinfo);
-    if (!pf) {
-#ifdef _MSC_VER
-      char buf[MAX_PATH];
-      (void)GetFullPathNameA(mixedfile.c_str(), MAX_PATH, buf, NULL);
-      quit(std::string("failed to create wav file ") + std::string(buf));
-#else
-      quit("failed to create wav file");
 #endif
     }
-    if (wavcsamp_fake != sf_writef_short(pf, wavsamples, wavcsamp_fake))
-      quit("problem writing mixed-wav file " + mixedfile);
-    if (0 != sf_close(pf))
-      warn("failed to close wav file");
-
-    info("parsing EDF body: splitting channels");
-    rawS16 = new short*[channels];
-    for (int j=0; j<channels_fake; ++j) {
-      rawS16[j] = new short[wavcsamp_fake];
-      std::copy(ps+j*wavcsamp_fake, ps+(j+1)*wavcsamp_fake, rawS16[j]);
-    }
 
   } else {
-    quit("unexpected suffix " + suffix + " of filename " + wavSrc);
+    // EDF, read in place.
+    recording = new EdfRecording(wavSrc);
+    // timeliner_run *playing* 94-channel audio is silly, and channels may differ in sample rate,
+    // so mixed.wav is only the first channel.  It still spans the whole recording, for tShowBound.
+    channelsMixed = 1;
+    pfMixed = openMixed(mixedfile, recording->sr(0), channelsMixed);
+    if (recording->sr(0) != recording->rate(0))
+      warn("mixed.wav plays at " + to_str(recording->sr(0)) + " Hz, not " + to_str(recording->rate(0)) + " Hz, so it and the timeline are off by " +
+	to_str(100.0 * fabs(recording->sr(0) / recording->rate(0) - 1.0)) + "%.  Features aren't.");
+  }
+
+  // Duration of mixed.wav, which timeliner_run's tShowBound spans.
+  // Its header's rate is rounded, unlike the rates that features' periods come from.
+  const double tEnd = recording->csamp(0) / double(recording->sr(0));
+  // What every feature depends on, besides its channel's rate and length, which its extractor's params() have.
+  const std::string source = fileIdentity(wavSrc) + " " + to_str(recording->channels());
+
+  // Every feature of every channel, its shards, and its mipmaps' chunks, all in parallel.
+  WorkerPool pool;
+  if (pfMixed) {
+    const long cb = WriteMixed::cbWork(channelsMixed);
+    pool.admit(cb);
+    (void)pool.task(new WriteMixed(pool, *recording, channelsMixed, pfMixed, mixedfile, cb));
   }
 
-  int iFeature=0;
   if (chdir(dirMarshal.c_str()) != 0)
     quit("failed to chdir to marshal dir " + dirMarshal);
-  if (-1 == system("rm -rf features*")) // will be deprecated, when timeliner_pre generates mipmaps directly
+  // Features that this run doesn't list are deleted afterwards.
+  // Without a previous manifest, what's here predates manifests.
+  const std::vector<MarshalEntry> manifestPrev = readManifest(".");
+  if (manifestPrev.empty() && -1 == system("rm -rf features*"))
     info("system(rm features*) failed");
-  char filename[20] = "features ";  // will be deprecated, when timeliner_pre generates mipmaps directly
+  std::vector<MarshalEntry> manifest;
   for (it=lines.begin(); it!=lines.end(); ++it) {
     std::vector<std::string> tokens = split(*it, ' ');
     if (tokens.size() < 2) {
@@ -815,24 +1707,29 @@ int mainCore(int argc, char** argv)
       warn("Config file " + configfile + ": ignoring line starting with negative feature-type index: " + *it);
       continue;
     }
-    for (int chan=0; chan<channels_fake; ++chan) {
+    for (unsigned chan=0; chan<recording->channels(); ++chan) {
       std::cout << "Constructing feature from channel " << chan << " of kind " << iColormap << " from source " << wavSrc << " with caption " << caption << "\n"; // << " and " << tokens.size() << " more args\n";
-      const Feature feat(chan, iColormap, wavSrc, caption);
-      filename[8] = '0' + iFeature;
-      marshal(filename, feat);
-      ++iFeature;
-      assert(iFeature<10); // will be deprecated, when timeliner_pre generates mipmaps directly
+      addFeature(pool, extractor(*recording, chan, iColormap, wavSrc), source, chan, iColormap, caption, tEnd, manifest);
     }
   }
-  for (unsigned chan=0; chan<channels; ++chan) {
-    const Feature feat(chan, wavSrc);
-    filename[8] = '0' + iFeature;
-    marshal(filename, feat);
-    ++iFeature;
-    assert(iFeature<10); // will be deprecated, when timeliner_pre generates mipmaps directly
+  for (unsigned chan=0; chan<recording->channels(); ++chan) {
+    std::cout << "Constructing waveform-feature for channel " << chan << "\n";
+    addFeature(pool, new WaveformExtractor(*recording, chan), source, chan, 5 /*shader*/, "waveform-as-feature", tEnd, manifest);
+  }
+  pool.wait();
+  if (!writeManifest(".", manifest))
+    quit("failed to write manifest in marshal dir " + dirMarshal);
+  // Not just what the previous manifest listed, but also what interrupted runs left unlisted.
+  const std::vector<std::string> files = filesStartingWith("features");
+  for (std::vector<std::string>::const_iterator it = files.begin(); it != files.end(); ++it) {
+    bool fListed = false;
+    for (std::vector<MarshalEntry>::const_iterator jt = manifest.begin(); jt != manifest.end(); ++jt)
+      fListed |= *it == jt->filename || *it == jt->filename + ".mip";
+    if (!fListed && remove(it->c_str()) != 0)
+      warn("failed to delete stale " + *it + " from marshal dir " + dirMarshal);
   }
 
-  for (unsigned i=0; i<channels; ++i) delete [] rawS16[i];
+  delete recording;
   return 0;
 }
 
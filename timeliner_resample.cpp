@@ -0,0 +1,132 @@
+#include "timeliner_resample.h"
+
+#include <algorithm>
+#include <cmath>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+// Zeroth-order modified Bessel function of the first kind, for the Kaiser window.
+static double besselI0(const double x)
+{
+  double sum = 1.0;
+  double term = 1.0;
+  for (int k=1; k<50 && term > sum*1e-12; ++k) {
+    const double t = x / (2.0*k);
+    term *= t*t;
+    sum += term;
+  }
+  return sum;
+}
+
+// Sum of a[i]*b[i], for n a multiple of 4.
+static inline float dot(const float* a, const float* b, const int n)
+{
+#if defined(__SSE__)
+  __m128 sum = _mm_setzero_ps();
+  for (int i=0; i<n; i+=4)
+    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i)));
+  float r[4];
+  _mm_storeu_ps(r, sum);
+  return (r[0] + r[1]) + (r[2] + r[3]);
+#else
+  float sum = 0.0f;
+  for (int i=0; i<n; ++i)
+    sum += a[i] * b[i];
+  return sum;
+#endif
+}
+
+Resampler::Resampler(const unsigned rateIn, const unsigned rateOut) :
+  _step(double(rateIn) / rateOut),
+  _taps(32),
+  _pos(0.0),
+  _fIdentity(rateIn == rateOut)
+{
+  // Cutoff, as a fraction of the input's Nyquist rate.  A little below the lower Nyquist rate,
+  // to leave room for the transition band.
+  const double ratio = std::min(1.0, double(rateOut) / rateIn);
+  const double cutoff = 0.92 * ratio;
+  // A lower cutoff needs proportionally more taps for the same transition band.
+  _taps = std::min(256, int(ceil(_taps / ratio / 4.0)) * 4);
+  const double halfwidth = _taps / 2;
+  const double beta = 8.0; // Kaiser:  about 80 dB stopband.
+  const double i0beta = besselI0(beta);
+
+  _filter.resize((phasesLim+1) * _taps);
+  for (int p=0; p<=phasesLim; ++p) {
+    const double frac = double(p) / phasesLim;
+    for (int k=0; k<_taps; ++k) {
+      // Distance from the output sample to input sample k.
+      const double x = (k - _taps/2 + 1) - frac;
+      const double y = cutoff * x;
+      const double sinc = fabs(y) < 1e-9 ? 1.0 : sin(M_PI*y) / (M_PI*y);
+      const double r = x / halfwidth;
+      const double window = besselI0(beta * sqrt(std::max(0.0, 1.0 - r*r))) / i0beta;
+      _filter[p*_taps + k] = float(cutoff * sinc * window);
+    }
+  }
+  reset();
+}
+
+// History of silence, so the first output is the first input.
+void Resampler::reset()
+{
+  if (_fIdentity) {
+    _in.clear();
+    _pos = 0.0;
+    return;
+  }
+  _in.assign(_taps/2 - 1, 0.0f);
+  _pos = _taps/2 - 1;
+}
+
+int Resampler::needed(const int cOut) const
+{
+  if (cOut <= 0)
+    return 0;
+  if (_fIdentity)
+    return std::max(0, cOut - int(_in.size()));
+  const double posLast = _pos + (cOut-1) * _step;
+  return std::max(0, int(floor(posLast)) + _taps/2 + 1 - int(_in.size()));
+}
+
+void Resampler::push(const short* src, const int c)
+{
+  _in.insert(_in.end(), src, src + c);
+}
+
+int Resampler::pull(short* dst, const int cMax)
+{
+  int c = 0;
+  if (_fIdentity) {
+    c = std::min(cMax, int(_in.size()));
+    for (int i=0; i<c; ++i)
+      dst[i] = short(_in[i]);
+    _in.erase(_in.begin(), _in.begin() + c);
+    return c;
+  }
+
+  for (; c<cMax; ++c, _pos += _step) {
+    const int base = int(floor(_pos));
+    if (base + _taps/2 >= int(_in.size()))
+      break; // Need more input.
+    const double phase = (_pos - base) * phasesLim;
+    const int p = std::min(int(phase), phasesLim-1);
+    const float a = float(phase - p);
+    const float* x = &_in[base - _taps/2 + 1];
+    const float* h = &_filter[p * _taps];
+    const float z0 = dot(x, h, _taps);
+    const float z1 = dot(x, h + _taps, _taps);
+    const float z = z0 + a*(z1 - z0);
+    dst[c] = short(std::max(-32768.0f, std::min(32767.0f, floorf(z + 0.5f))));
+  }
+
+  // Keep just the history that the next output needs.
+  const int drop = std::min(int(floor(_pos)) - (_taps/2 - 1), int(_in.size()));
+  if (drop > 0) {
+    _in.erase(_in.begin(), _in.begin() + drop);
+    _pos -= drop;
+  }
+  return c;
+}
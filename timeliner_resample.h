@@ -0,0 +1,28 @@
+#pragma once
+#include <vector>
+
+// Streaming sample-rate converter for playback, from a recording's rate to the soundcard's.
+//
+// Polyphase windowed sinc:  a Kaiser-windowed sinc, tabulated at phasesLim fractional offsets,
+// linearly interpolated between adjacent offsets, so any ratio of rates works.
+// Each output sample costs two dot products of _taps floats, whatever the rates.
+// When downsampling, the cutoff drops below the output's Nyquist rate, to prevent aliasing.
+
+class Resampler {
+public:
+  Resampler(unsigned rateIn, unsigned rateOut);
+
+  void reset();				// Forget the input, e.g. when playback jumps elsewhere.
+  int needed(int cOut) const;		// How much more input to push() to pull() that many.
+  void push(const short* src, int c);	// Append input.
+  int pull(short* dst, int cMax);	// Make up to cMax outputs.  Returns how many.
+
+private:
+  enum { phasesLim = 256 };
+  const double _step;		// input samples per output sample
+  int _taps;			// per phase, even
+  std::vector<float> _filter;	// (phasesLim+1) phases of _taps taps each
+  std::vector<float> _in;	// input not yet consumed, including _taps/2 of history
+  double _pos;			// offset into _in of the next output sample
+  const bool _fIdentity;	// Same rates, so just copy.
+};
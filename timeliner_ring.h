@@ -0,0 +1,57 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+
+// Lock-free ring buffer for exactly one producer thread and one consumer thread,
+// e.g. samplewriter() and samplereader().
+// Neither thread ever waits for the other, so the consumer can be a realtime audio thread.
+//
+// Each index is written by only one thread.  The release-store of an index publishes
+// the elements before it, and the other thread's acquire-load sees them.
+template <class T, size_t N> class RingBuffer {
+  static_assert(N > 0 && (N & (N-1)) == 0, "RingBuffer's size must be a power of two.");
+  T _buf[N];
+  std::atomic<size_t> _iWrite; // Total elements ever written.  Only the producer stores this.
+  std::atomic<size_t> _iRead;  // Total elements ever read.  Only the consumer stores this.
+public:
+  RingBuffer() : _iWrite(0), _iRead(0) {}
+
+  // Either thread.  Already stale when it returns, but conservatively so for the caller:
+  // the producer sees at least this much room, the consumer at least this much data.
+  size_t readable() const { return _iWrite.load(std::memory_order_acquire) - _iRead.load(std::memory_order_acquire); }
+  size_t writable() const { return N - readable(); }
+  static constexpr size_t capacity() { return N; }
+
+  // Producer only.  Returns how many were copied from src.
+  size_t write(const T* src, size_t n) {
+    const size_t iWrite = _iWrite.load(std::memory_order_relaxed);
+    n = std::min(n, N - (iWrite - _iRead.load(std::memory_order_acquire)));
+    const size_t i = iWrite & (N-1);
+    const size_t n0 = std::min(n, N - i); // Before wrapping around.
+    std::copy(src, src + n0, _buf + i);
+    std::copy(src + n0, src + n, _buf);
+    _iWrite.store(iWrite + n, std::memory_order_release);
+    return n;
+  }
+
+  // Consumer only.  Returns how many were copied to dst.
+  size_t read(T* dst, size_t n) {
+    const size_t iRead = _iRead.load(std::memory_order_relaxed);
+    n = std::min(n, _iWrite.load(std::memory_order_acquire) - iRead);
+    const size_t i = iRead & (N-1);
+    const size_t n0 = std::min(n, N - i);
+    std::copy(_buf + i, _buf + i + n0, dst);
+    std::copy(_buf, _buf + (n - n0), dst + n0);
+    _iRead.store(iRead + n, std::memory_order_release);
+    return n;
+  }
+
+  // Consumer only.  Like read(), but discarding them.
+  size_t skip(size_t n) {
+    const size_t iRead = _iRead.load(std::memory_order_relaxed);
+    n = std::min(n, _iWrite.load(std::memory_order_acquire) - iRead);
+    _iRead.store(iRead + n, std::memory_order_release);
+    return n;
+  }
+};
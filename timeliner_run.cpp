@@ -7,6 +7,12 @@
 #include "timeliner_cache.h"
 #include "timeliner_util.h" // #includes <windows.h>
 #include "timeliner_util_threads.h"
+#include "timeliner_feature.h"
+#include "timeliner_gpumem.h"
+#include "timeliner_marshal.h"
+#include "timeliner_resample.h"
+#include "timeliner_ring.h"
+#include "timeliner_stretch.h"
 
 // Linux:   apt-get install libsndfile1-dev
 // Windows: www.mega-nerd.com/libsndfile/ libsndfile-1.0.25-w64-setup.exe
@@ -29,6 +35,7 @@
 #include <cstring>
 #include <fcntl.h>
 #include <fstream>
+#include <sstream>
 
 #ifdef _MSC_VER
 #include <time.h>
@@ -37,6 +44,7 @@
 #include <functional>
 #else
 #include <pthread.h>
+#include <semaphore.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h> // mkdir
 #include <sys/time.h>
@@ -183,14 +191,39 @@ bool onscreen(const double sec) { return sec >= tShow[0] && sec <= tShow[1]; }
 
 int SR = -1;
 
-arLock vlockAudio; // guards next three
-int vnumSamples = 0; // high-low-water-mark between samplewriter() and samplereader()
-const short* vpsSamples = NULL; // vpsSamples and visSamples are set by samplewriter() via emit(), and cleared by samplereader().
-int visSamples = 0;
+// Audio from samplewriter() to samplereader(), without locks.  A third of a second at 96 kHz.
+RingBuffer<short, 32768> vringAudio;
+// How far ahead of the sound device samplewriter() fills vringAudio, set by samplereader().
+// At most vringAudio's capacity.
+std::atomic<int> vcsampAhead(0);
+std::atomic<unsigned> vrateAudio(0); // Soundcard's sample rate, set by samplereader() before vcsampAhead.
+std::atomic<unsigned> vgenPlay(0); // Incremented when playing starts somewhere new.
+std::atomic<bool> vfRestartAudio(false); // Playing started, so drop the silence queued in the soundcard.
+std::atomic<bool> vfFlushAudio(false); // Playing stopped or restarted, so samplereader() drops vringAudio.
+
+#ifdef _MSC_VER
+void wakeSamplewriter() {}
+void waitSamplewriter() { snooze(0.005); }
+#else
+sem_t vsemAudio; // Wakes samplewriter() when vringAudio has room, or when playing starts.
+void wakeSamplewriter() { (void)sem_post(&vsemAudio); } // Never blocks, so the audio thread may call it.
+void waitSamplewriter() {
+  // Not forever, to notice vfQuit.
+  struct timespec t;
+  clock_gettime(CLOCK_REALTIME, &t);
+  t.tv_nsec += 30000000;
+  if (t.tv_nsec >= 1000000000) {
+    t.tv_nsec -= 1000000000;
+    ++t.tv_sec;
+  }
+  (void)sem_timedwait(&vsemAudio, &t);
+}
+#endif
 
 class S2Splay {
 public:
-  S2Splay() : _sPlay(-1.0), _sPlayPrev(-1.0), _tPlay(appnow()), _fPlaying(false), _sampBgn(10000) {}
+  S2Splay() : _sPlay(-1.0), _sPlayPrev(-1.0), _tPlay(appnow()), _sCursor(-1.0), _fPlaying(false), _sampBgn(10000),
+    _speed(1.0), _fScrub(false), _sScrub(0.0), _gen(0) {}
   bool playing() const { arGuard _(_lock); return _fPlaying; }
   void soundpause() { arGuard _(_lock); _fPlaying = false; }
 
@@ -218,32 +251,70 @@ public:
     return true;
   }
 
-  // Report position of the next numSamples of audio,
-  // starting implicitly at _sampBgn,
-  // by setting vpsSamples and visSamples,
-  // and updating _sampBgn for the next emit().
+  // Stuff dst with the next numSamples of audio,
+  // starting implicitly at _sampBgn, time-stretched by wsola to the playback speed,
+  // and update _sampBgn for the next emit().
+  // Return how many it stuffed, fewer only at the end of the recording,
+  // or none if playback jumped meanwhile, because those are from the old place.
   //
-  // Called from inside vlockAudio.lock();
-  void emit(int numSamples /* actually is vnumSamples */) {
-    assert(vnumSamples > 0); // true but not helpful
-    arGuard _(_lock);
-    long sampEnd = _sampBgn + numSamples;
-    const bool fPastEnd = sampEnd > wavcsamp;
-    if (fPastEnd) {
-      // truncate, and cease playing thereafter
-      sampEnd = wavcsamp;
-      numSamples = sampEnd - _sampBgn;
+  // Called by samplewriter().  Stretches outside the lock, to not delay drawing.
+  int emit(int numSamples, short* dst, Wsola& wsola) {
+    assert(numSamples > 0);
+    double pos, speed;
+    unsigned gen;
+    {
+      arGuard _(_lock);
+      if (!_fPlaying)
+	return 0;
+      pos = _sampBgn;
+      gen = _gen;
+      speed = _fScrub ? speedScrubNolock() : _speed;
     }
-    const short* psStart = wavS16 + _sampBgn;
-    vpsSamples = psStart;
-    visSamples += numSamples;
-    _sampBgn += numSamples;
+    numSamples = wsola.process(wavS16, wavcsamp, pos, speed, dst, numSamples);
+
+    arGuard _(_lock);
+    if (gen != _gen)
+      return 0; // Meanwhile, playback jumped elsewhere.
+    _sampBgn = pos;
     //not true when hit space to stop playing. assert(_fPlaying);
-    if (fPastEnd)
-      _fPlaying = false;
+    if (numSamples == 0 && !_fScrub)
+      _fPlaying = false; // Past the end.
 
     // Stop playing if cursor moves offscreen, or screen moves off cursor.
-    _fPlaying &= onscreen(sPlayCursor1Nolock());
+    if (!_fScrub)
+      _fPlaying &= onscreen(sPlayCursor1Nolock());
+    return numSamples;
+  }
+
+  // Playback speed, pitch unchanged.
+  void faster(const double k) {
+    arGuard _(_lock);
+    // Keep the cursor where it is.
+    _sCursor = sPlayCursor1Nolock();
+    _tPlay = appnow();
+    _speed = k == 0.0 ? 1.0 : std::max(0.5, std::min(8.0, _speed * k));
+    printf("Playback speed %gx.\n", _speed);
+  }
+
+  // While the right button drags, play whatever's under the mouse, as fast as it moves.
+  void scrub(const double s) {
+    arGuard _(_lock);
+    if (!_fScrub) {
+      soundplayNolock(s);
+      if (!_fPlaying)
+	return;
+      _fScrub = true;
+      restartAudio();
+    }
+    _sScrub = s;
+  }
+  void scrubEnd() {
+    arGuard _(_lock);
+    if (!_fScrub)
+      return;
+    _fScrub = false;
+    _fPlaying = false;
+    vfFlushAudio = true;
   }
 
   void spacebar(double s) {
@@ -260,13 +331,16 @@ public:
       // or the user's explicit repositioning of purple cursor (that's better).
       if (f && s==_sPlayPrev) {
 	_fPlaying = false;
+	vfFlushAudio = true;
 #ifdef making_movie
 	if (fMovieRecording)
 	  fprintf(fpMovie, "# audio playback stop at offset = %f s\n", sPlayCursor1Nolock());
 #endif
       } else {
 	_sPlayPrev = s;
+	_fScrub = false;
 	soundplayNolock(s);
+	restartAudio();
 #ifdef making_movie
 	if (fMovieRecording)
 	  fprintf(fpMovie, "# audio playback start from wavfile offset = %f s, at screenshot-recording offset = %f s\n", s, appnow() - sMovieRecordingStart);
@@ -277,7 +351,7 @@ public:
 
 #ifdef making_movie
   void moviePlayback(const double s, const double t) {
-    _sPlay = s;
+    _sPlay = _sCursor = s;
     _tPlay = s + appnow() - t; // inverse of sPlayCursor1Nolock()
   }
 #endif
@@ -294,19 +368,42 @@ private:
     // arGuard _(_lock); *would* go here.
     _sampBgn = sampBgn;
     _tPlay = appnow();
-    _sPlay = t;
+    _sPlay = _sCursor = t;
     _fPlaying = true;
+    ++_gen;
     //info("playing at #{t}");
   }
 
-  double sPlayCursor1Nolock() const { return _sPlay + (appnow() - _tPlay); }
+  // Tell samplereader() and samplewriter() that playback jumped.
+  void restartAudio() {
+    vfFlushAudio = true; // What's left from the previous play.
+    vfRestartAudio = true;
+    ++vgenPlay;
+    wakeSamplewriter();
+  }
+
+  // Fast enough to reach the mouse in about a tenth of a second.
+  double speedScrubNolock() const {
+    const double secsLag = 0.1;
+    const double speed = (_sScrub - _sampBgn/SR) / secsLag;
+    return std::max(-8.0, std::min(8.0, speed));
+  }
+
+  double sPlayCursor1Nolock() const {
+    return _fScrub ? _sampBgn/SR : _sCursor + (appnow() - _tPlay) * _speed;
+  }
 
   mutable arLock _lock; // guards all member variables
   double _sPlay;
   double _sPlayPrev;
   double _tPlay;
+  double _sCursor;	// where the cursor was at _tPlay
   bool _fPlaying;
-  long _sampBgn;
+  double _sampBgn;	// not long, because at other speeds it advances fractionally
+  double _speed;
+  bool _fScrub;
+  double _sScrub;	// where the mouse is, while scrubbing
+  unsigned _gen;	// Incremented when playback jumps.
 };
 
 S2Splay s2s;
@@ -351,24 +448,33 @@ inline float drand48() { return float(rand()) / float(RAND_MAX); }
 
 WorkerPool* pool = NULL;
 
-int Feature::mb = mbUnknown;
 std::vector<Feature*> features;
+std::vector<bool> featuresShown; // By the last drawFeatures(), so prefetch only those.
 
-std::vector<GLuint> myPrgs;
+// Two programs shared by all features:  one for 1D textures, one for compressed 2D textures.
+enum { prg1D, prg2D, prgLim };
+GLuint myPrgs[prgLim] = {0};
+GLint locPaletteRow[prgLim];
 bool fShaderValid(const int i)
 {
-  return 0<=i && i<int(myPrgs.size()) && myPrgs[i]!=0;
+  return 0<=i && i<prgLim && myPrgs[i]!=0;
 }
 void shaderUse(const int i = -1)
 {
   glUseProgram(fShaderValid(i) ? myPrgs[i] : 0);
 }
 
+// Palettes, one row per feature, in a texture on texture unit 1.
+// Unlike a uniform array (which failed to link at 256 entries), this has room for finer palettes,
+// and changing them is a single small upload instead of recompiling and relinking.
+const int paletteSize = 256;
+GLuint texPalette = 0;
+int palettes = 0;
+
 GLfloat paletteBrightness = 1.0;
-void setPalette(const int iShader, const GLfloat r, const GLfloat g, const GLfloat b) {
-  static GLfloat bufPalette[3*128]; // One bufPalette is enough for multiple shaders.
-  for (int i=0; i<128; ++i) {
-    const GLfloat z(paletteBrightness * sq(i/127.0f));
+void setPalette(GLfloat* bufPalette, const int iShader, const GLfloat r, const GLfloat g, const GLfloat b) {
+  for (int i=0; i<paletteSize; ++i) {
+    const GLfloat z(paletteBrightness * sq(i/GLfloat(paletteSize-1)));
     switch (iShader) {
     default:
       bufPalette[3*i+0] = z * r;
@@ -377,9 +483,9 @@ void setPalette(const int iShader, const GLfloat r, const GLfloat g, const GLflo
       break;
     case 0:
       // waveform
-      bufPalette[3*i+0] = i<127 ? 0.0f : r;
-      bufPalette[3*i+1] = i<127 ? 0.0f : g;
-      bufPalette[3*i+2] = i<127 ? 0.0f : b;
+      bufPalette[3*i+0] = i<paletteSize-1 ? 0.0f : r;
+      bufPalette[3*i+1] = i<paletteSize-1 ? 0.0f : g;
+      bufPalette[3*i+2] = i<paletteSize-1 ? 0.0f : b;
       break;
     case 1:
       // blackbody: black red yellow white.
@@ -392,29 +498,59 @@ void setPalette(const int iShader, const GLfloat r, const GLfloat g, const GLflo
       break;
     }
   }
-  assert(fShaderValid(iShader));
-  assert(      glGetUniformLocation(myPrgs[iShader], "palette") >= 0);
-  glUniform1fv(glGetUniformLocation(myPrgs[iShader], "palette"), 3*128, bufPalette);
 }
 
-void shaderRestart(const int iShader, const double r, const double g, const double b) {
-  // Recompiling the shaders may be overkill for just redoing setPalette().
-  shaderUse();
-  if (fShaderValid(iShader))
-    glDeleteProgram(myPrgs[iShader]);
-  if (int(myPrgs.size()) < iShader+1) myPrgs.resize(iShader+1, -1);
+// Recompute all palettes, e.g. after paletteBrightness changes.
+void setPalettes()
+{
+  std::vector<GLfloat> buf(3*paletteSize*palettes);
+  setPalette(&buf[0], 0,  0.2f, 1.0f, 0.2f); // waveform is green
+  for (int i=1; i<palettes; ++i)
+    setPalette(&buf[3*paletteSize*i], i,  0.9f-0.2f*i, 0.7f, 0.4f+0.1f*i);
+  // Values above 1.0 are clamped, as gl_FragColor would have been.
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, texPalette);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, paletteSize, palettes, GL_RGB, GL_FLOAT, &buf[0]);
+  glActiveTexture(GL_TEXTURE0);
+}
+
+void paletteInit()
+{
+  palettes = std::max(1, int(features.size()));
+  glGenTextures(1, &texPalette);
+  glActiveTexture(GL_TEXTURE1); // Leave it bound there, for the shaders.
+  glBindTexture(GL_TEXTURE_2D, texPalette);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, paletteSize, palettes, 0, GL_RGB, GL_FLOAT, NULL);
+  gpuBudget.alloc(3*paletteSize*palettes);
+  glActiveTexture(GL_TEXTURE0);
+  setPalettes();
+}
+
+// f2D means a feature of compressed 2D textures (see Feature::compressed).
+void shaderBuild(const int iShader, const bool f2D) {
   myPrgs[iShader] = glCreateProgram();
   const GLuint& myPrg = myPrgs[iShader];
   assert(myPrg > 0);
   const GLuint myVS = glCreateShader(GL_VERTEX_SHADER);
   const GLuint myFS = glCreateShader(GL_FRAGMENT_SHADER);
   // For GLSL 1.30+, should pedantically define my own AttrMultiTexCoord0 instead of deprecated gl_MultiTexCoord0.
-  const GLchar* prgV = "varying float u; void main() { gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex; u = gl_MultiTexCoord0.s; }";
-  const GLchar* prgF = "varying float u; uniform sampler1D heatmap; uniform float palette[3*128]; \n void main() {\n\
+  const GLchar* prgV = f2D ?
+    "varying vec2 u; void main() { gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex; u = gl_MultiTexCoord0.st; }" :
+    "varying float u; void main() { gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex; u = gl_MultiTexCoord0.s; }";
+  // paletteRow is the v texture coordinate of this feature's row of texPalette.
+  // The u coordinate maps 0..1 to the centers of the first and last texels.
+  const GLchar* prgF = f2D ?
+"varying vec2 u; uniform sampler2D heatmap; uniform sampler2D palette; uniform float paletteRow; \n void main() {\n\
+    float i = texture2D(heatmap, u).r; // 0 to 1\n\
+    gl_FragColor = vec4(texture2D(palette, vec2((0.5 + i*255.0)/256.0, paletteRow)).rgb, 1.0);\n\
+}" :
+"varying float u; uniform sampler1D heatmap; uniform sampler2D palette; uniform float paletteRow; \n void main() {\n\
     float i = texture1D(heatmap, u).r; // 0 to 1\n\
-    int j = int(i*127.0) * 3; // 0 to 127*3, by 3's\n\
-    // gl_FragColor = vec4(i,1.0-i,1.0-i,1.0);\n\
-    gl_FragColor = vec4(palette[j],palette[j+1],palette[j+2],1.0);\n\
+    gl_FragColor = vec4(texture2D(palette, vec2((0.5 + i*255.0)/256.0, paletteRow)).rgb, 1.0);\n\
 }";
   glShaderSource(myVS, 1, &prgV, NULL);
   glShaderSource(myFS, 1, &prgF, NULL);
@@ -442,33 +578,30 @@ void shaderRestart(const int iShader, const double r, const double g, const doub
   //glGetProgramInfoLog(myPrg, cch, &cch2, sz);
   //if (cch2>0) printf("shader link: %d, %s\n", r, sz);
 
-  // 128 works, but 256 fails to glLinkProgram (and segfaults in glGetProgramInfoLog).
-  // 3000-ish bytes may be the maximum for a uniform array.
-  //
-  // Alternatives: UBO; texelFetch() a buffer texture (TBO), SSBO.
-  // http://stackoverflow.com/questions/7954927/glsl-passing-a-list-of-values-to-fragment-shader
-  // http://rastergrid.com/blog/2010/01/uniform-buffers-vs-texture-buffers/
-
   shaderUse(iShader); // before calling any glUniform()s, so they know which program to refer to.
-  setPalette(iShader, GLfloat(r),GLfloat(g),GLfloat(b));
-
-  glActiveTexture(GL_TEXTURE0); // use texture unit 0
   assert(     glGetUniformLocation(myPrg, "heatmap") >= 0);
   glUniform1i(glGetUniformLocation(myPrg, "heatmap"), 0); // Bind sampler to texture unit 0.  www.opengl.org/wiki/Texture#Texture_image_units
+  assert(     glGetUniformLocation(myPrg, "palette") >= 0);
+  glUniform1i(glGetUniformLocation(myPrg, "palette"), 1);
+  locPaletteRow[iShader] = glGetUniformLocation(myPrg, "paletteRow");
+  assert(locPaletteRow[iShader] >= 0);
+  shaderUse();
 }
 
-void kickShaders()
+// Use the shader for the i'th feature.
+void shaderUseFeature(const unsigned i)
 {
-  shaderRestart(0,  0.2, 1.0, 0.2); // waveform is green
-  for (unsigned i=1; i<features.size(); ++i)
-    shaderRestart(i,  0.9-0.2*i, 0.7, 0.4+0.1*i);
+  const int iShader = features[i]->compressed() ? prg2D : prg1D;
+  shaderUse(iShader);
+  glUniform1f(locPaletteRow[iShader], GLfloat((i + 0.5) / palettes));
 }
 
 void shaderInit()
 {
-  glewInit();
   assert(glewIsSupported("GL_VERSION_2_0"));
-  kickShaders();
+  paletteInit();
+  shaderBuild(prg1D, false);
+  shaderBuild(prg2D, true);
 }
 
 // Top of timeline, measured from bottom of window (y==0) to top of window (y==1).
@@ -485,6 +618,26 @@ const double yBetweenWaveformAndFeatures = 0.2;
 const double yBetweenWaveformAndFeatures = 0.0;
 #endif
 
+// Whether the environment variable timeliner_features, a comma-separated list of captions,
+// each optionally followed by a slash and a channel, e.g. ExampleMFCC,waveform-as-feature/0,
+// asks for this feature.  Without that variable, show them all.
+bool fShowFeature(const MarshalEntry& e)
+{
+  const char* pch = getenv("timeliner_features");
+  if (!pch)
+    return true;
+  std::istringstream is(pch);
+  std::string item;
+  while (std::getline(is, item, ',')) {
+    const size_t slash = item.find('/');
+    if (item.substr(0, slash) != e.caption)
+      continue;
+    if (slash == std::string::npos || atoi(item.c_str() + slash + 1) == e.channel)
+      return true;
+  }
+  return false;
+}
+
 void drawFeatures()
 {
   if (features.empty())
@@ -493,8 +646,7 @@ void drawFeatures()
   std::vector<Feature*>::const_iterator f;
 
   // Compute y's: amortize among vectorsizes.  Sqrt gives "thin" features more space.
-  double rgdy[100]; //hardcoded;;  instead, grow a vector.
-  assert(features.size() < 100);
+  std::vector<double> rgdy(features.size());
   int i=0;
   double sum = 0.0;
   for (f=features.begin(); f!=features.end(); ++f) {
@@ -502,10 +654,9 @@ void drawFeatures()
     // todo: adapt to pixelSize[1]
     const double dy = !strcmp((*f)->name(), "waveform-as-feature") ? 1.5 : sqrt(double((*f)->vectorsize()));
     sum += rgdy[i++] = dy;
-    assert(i < 100); //hardcoded;;
   }
   // rgdy[0 .. i-1] are heights.
-  double rgy[100]; //hardcoded;;
+  std::vector<double> rgy(i+1);
   rgy[0] = yBetweenWaveformAndFeatures;
   rgy[i] = 1.0;
   {
@@ -515,36 +666,63 @@ void drawFeatures()
     // rgy [0 .. i] are boundaries between features.
   }
 
+  // Mark the features that are shown, or about to be, for prefetch() to load.
+  // Loading here could wait for the pool.
+  const double yLoad[2] = { std::min(yShow[0], yAim[0]), std::max(yShow[1], yAim[1]) };
+  featuresShown.assign(features.size(), false);
   for (f=features.begin(),i=0; f!=features.end(); ++f,++i) {
-    shaderUse(i);
-    const double* p = rgy + i;
-      glDisable(GL_TEXTURE_2D);
-      glEnable(GL_TEXTURE_1D);
+    const double* p = &rgy[i];
+    if (p[1] <= yLoad[0] || yLoad[1] <= p[0])
+      continue; // offscreen
+    featuresShown[i] = true;
+    if (!(*f)->loaded())
+      continue;
+    shaderUseFeature(i);
+      const bool f2D = (*f)->compressed();
+      glDisable(f2D ? GL_TEXTURE_1D : GL_TEXTURE_2D);
+      glEnable (f2D ? GL_TEXTURE_2D : GL_TEXTURE_1D);
       glColor4d(0.9,1.0,0.4, 1.0);
+      glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
       const int jMax = (*f)->vectorsize();
       for (int ichunk=0; ichunk < (*f)->cchunk; ++ichunk) {
+	const double chunkL =  ichunk    / double((*f)->cchunk); // e.g., 5/8
+	const double chunkR = (ichunk+1) / double((*f)->cchunk); // e.g., 6/8
+	const double tBoundL = lerp(chunkL, tShowBound[0], tShowBound[1]);
+	const double tBoundR = lerp(chunkR, tShowBound[0], tShowBound[1]);
+	const double xL = (tBoundL - tShow[0]) / (tShow[1] - tShow[0]);
+	const double xR = (tBoundR - tShow[0]) / (tShow[1] - tShow[0]);
+	if (xR < 0.0 || 1.0 < xL)
+	  continue; // offscreen
+	if (!(*f)->drawable(ichunk))
+	  continue; // Not even its eager levels are uploaded yet.
+	if (f2D) {
+	  // No mipmapping within a 2D texture, so pick the level here.
+	  const int level = std::max((*f)->levelFromPixels((xR-xL) * pixelSize[0]), (*f)->levelBase[ichunk]);
+	  const GLuint t = (*f)->rgTex[ichunk].texLevel[level];
+	  assert(glIsTexture(t) == GL_TRUE);
+	  glBindTexture(GL_TEXTURE_2D, t);
+	}
 	for (int j=0; j<jMax; ++j) {
-	  const double chunkL =  ichunk    / double((*f)->cchunk); // e.g., 5/8
-	  const double chunkR = (ichunk+1) / double((*f)->cchunk); // e.g., 6/8
-	  const double tBoundL = lerp(chunkL, tShowBound[0], tShowBound[1]);
-	  const double tBoundR = lerp(chunkR, tShowBound[0], tShowBound[1]);
-	  const double xL = (tBoundL - tShow[0]) / (tShow[1] - tShow[0]);
-	  const double xR = (tBoundR - tShow[0]) / (tShow[1] - tShow[0]);
-	  if (xR < 0.0 || 1.0 < xL)
-	    continue; // offscreen
-	  assert(glIsTexture((*f)->rgTex[ichunk].tex[j]) == GL_TRUE);
-	  glBindTexture(GL_TEXTURE_1D, (*f)->rgTex[ichunk].tex[j]);
-	  glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
 	  const double yMin = lerp(double(j  )/jMax, p[0], p[1]);
 	  const double yMax = lerp(double(j+1)/jMax, p[0], p[1]);
 	  assert(p[0]<=yMin && yMin<yMax && yMax<=p[1]);
+	  if (f2D) {
+	    const double v = (j+0.5) / jMax; // Row j's texel centers.
+	    glBegin(GL_QUADS);
+	      glTexCoord2d(0.0, v); glVertex2d(xL, yMin); glVertex2d(xL, yMax);
+	      glTexCoord2d(1.0, v); glVertex2d(xR, yMax); glVertex2d(xR, yMin);
+	    glEnd();
+	    continue;
+	  }
+	  assert(glIsTexture((*f)->rgTex[ichunk].tex[j]) == GL_TRUE);
+	  glBindTexture(GL_TEXTURE_1D, (*f)->rgTex[ichunk].tex[j]);
 	  glBegin(GL_QUADS);
 	    glTexCoord1d(0.0); glVertex2d(xL, yMin); glVertex2d(xL, yMax);
 	    glTexCoord1d(1.0); glVertex2d(xR, yMax); glVertex2d(xR, yMin);
 	  glEnd();
 	}
       }
-      glDisable(GL_TEXTURE_1D);
+      glDisable(f2D ? GL_TEXTURE_2D : GL_TEXTURE_1D);
     glColor4f(1,1,0,1);
     glRasterPos2d(0.01, p[0] + 0.005);
     putsGlut((*f)->name());
@@ -857,7 +1035,8 @@ void aim()
   assert(yAim[1] > yShowBound[0]);
   aimCropY();
 
-  const double dyZoomMin = 1.0 / channels;
+  // Zoom in as far as one channel, or one feature, so the others needn't be loaded.
+  const double dyZoomMin = 1.0 / std::max(channels, unsigned(features.size()));
   const bool fZoominLimitY = yAim[1] - yAim[0] < dyZoomMin;
   if (fZoominLimitY) {
     // printf("Hit fZoominLimitY %.2f.\n", dyZoomMin); // aimCropY will also warn.
@@ -886,6 +1065,100 @@ void aim()
 #endif
 }
 
+// Where tAim is heading:  smoothed velocity of each end of tAim,
+// from dragging or from the key repeat of a, d, w, s.
+double tAimPrev[2];
+double tAimVelocity[2] = {0.0, 0.0};
+
+// tShow's low-pass filter follows tAim, and tAim follows its own velocity.
+// Predict where tShow will be, secsAhead from now.
+void predictShow(double tPredict[2], const double secsAhead)
+{
+  for (int i=0; i<2; ++i)
+    tPredict[i] = tAim[i] + tAimVelocity[i] * secsAhead;
+  if (tPredict[0] >= tPredict[1]) {
+    // Zoomin overshot.
+    tPredict[0] = tAim[0];
+    tPredict[1] = tAim[1];
+  }
+  tPredict[0] = std::max(tPredict[0], tShowBound[0]);
+  tPredict[1] = std::min(tPredict[1], tShowBound[1]);
+}
+
+// Request and upload texture chunks for what's onscreen and what will soon be.
+void prefetch()
+{
+  if (!pool || !fReshaped)
+    return;
+
+  // Key repeat is about 30 Hz, so average over several repeats.
+  static bool fFirst = true;
+  const double secsSmooth = 0.2;
+  const double k = fFirst || secsPerFrame <= 0.0 ? 0.0 : std::min(1.0, secsPerFrame / secsSmooth);
+  for (int i=0; i<2; ++i) {
+    if (k > 0.0)
+      tAimVelocity[i] = tAimVelocity[i]*(1.0-k) + k * (tAim[i] - tAimPrev[i]) / secsPerFrame;
+    tAimPrev[i] = tAim[i];
+  }
+  fFirst = false;
+
+  const double secsAhead = 0.5;
+  double tPredict[2];
+  predictShow(tPredict, secsAhead);
+  for (std::vector<Feature*>::iterator f = features.begin(); f != features.end(); ++f) {
+    if (!(*f)->loaded()) {
+      if (featuresShown.size() != features.size() || !featuresShown[f - features.begin()])
+	continue;
+      (*f)->load(*pool);
+      static bool fWarned = false;
+      if (gpuBudget.over() && !fWarned) {
+	fWarned = true;
+#ifdef _MSC_VER
+	warn("Out of graphics RAM.  Try increasing the environment variable timeliner_gpumb.");
+#else
+	warn("Out of graphics RAM.  Try export timeliner_gpumb=1000.");
+#endif
+      }
+    }
+    if (featuresShown.size() == features.size() && !featuresShown[f - features.begin()]) {
+      // Scrolled offscreen, so let its finer levels be evicted.
+      (*f)->cancelStale(*pool);
+      continue;
+    }
+    // Most urgent first.  Onscreen chunks overtake the rest in the pool.
+    (*f)->prefetch(*pool, tShow[0], tShow[1], pixelSize[0], WorkerPool::priorityHigh);
+    (*f)->prefetch(*pool, tAim[0], tAim[1], pixelSize[0], WorkerPool::priorityNormal);
+    (*f)->prefetch(*pool, tPredict[0], tPredict[1], pixelSize[0], WorkerPool::priorityNormal);
+    (*f)->cancelStale(*pool);
+  }
+
+  // Limit uploads per frame, to keep the frame rate smooth.
+  const long cbUploadPerFrame = 4L << 20;
+  const double secsUploadPerFrame = 0.004;
+
+  // Make room for them by evicting what hasn't been wanted for longest.
+  while (gpuBudget.over(cbUploadPerFrame)) {
+    unsigned frameOldest = Feature::frame;
+    Feature* fEvict = NULL;
+    int ichunkEvict = -1;
+    for (std::vector<Feature*>::iterator f = features.begin(); f != features.end(); ++f) {
+      if (!(*f)->loaded())
+	continue;
+      const int ichunk = (*f)->chunkToEvict(frameOldest);
+      if (ichunk >= 0) {
+	fEvict = *f;
+	ichunkEvict = ichunk;
+      }
+    }
+    if (!fEvict)
+      break; // Everything left is onscreen, or soon will be.
+    fEvict->evict(ichunkEvict);
+  }
+
+  pool->runMain(secsUploadPerFrame);
+  ++Feature::frame;
+}
+
 #if 0
 void debugYCoords()
 {
@@ -1105,7 +1378,17 @@ void keyboard(const unsigned char key, const int x, int /*y*/)
     case 'b'-'a'+1: // ctrl+B
       paletteBrightness = 1.0f;
 LReshade:
-      kickShaders();
+      setPalettes();
+      break;
+
+    case 'f':
+      s2s.faster(2.0);
+      break;
+    case 'F':
+      s2s.faster(0.5);
+      break;
+    case 'f'-'a'+1: // ctrl+F
+      s2s.faster(0.0);
       break;
 
 #ifdef making_movie
@@ -1163,8 +1446,11 @@ void drag(const int x, const int y)
 
     fDrag |= !vfFakeDrag; // distinguish left click from left drag
   }
-  if (fHeldRight)
+  if (fHeldRight) {
     sMouseRuler = secondFromGL(xFromMouse(x));
+    if (!vfFakeDrag)
+      s2s.scrub(sMouseRuler);
+  }
 
   // If you're dextrous enough to drag while holding both buttons, feel free to do so.
 }
@@ -1214,6 +1500,7 @@ void mouse(const int button, const int state, const int x, const int y)
     case GLUT_RIGHT_BUTTON*_ + GLUT_UP:
       fHeldRight = false;
       fDrag = false;
+      s2s.scrubEnd();
       break;
   }
   vfFakeDrag = true; // Ugly global, because drag()'s signature can't change.
@@ -1570,6 +1857,7 @@ void drawAll()
 
   glutSwapBuffers();
   aim();
+  prefetch();
 }
 
 void makeTextureNoise()
@@ -1579,10 +1867,11 @@ void makeTextureNoise()
   float a[w*h];
   for (int i=0; i<w*h; ++i) a[i] = drand48();
   glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, w, h, 0, GL_LUMINANCE, GL_FLOAT, a);
+  gpuBudget.alloc(w*h);
 }
 
-// When audio data arrives in {vpsSamples,visSamples},
-// send it to the soundcard.
+// Send audio from vringAudio to the soundcard.
+// This thread takes no locks and never waits for samplewriter(), only for the soundcard.
 #ifdef _MSC_VER
 extern void rtaudioInit(), rtaudioTick(const short*, int), rtaudioPause(bool), rtaudioTerm();
 extern int rtaudioBuf();
@@ -1594,88 +1883,151 @@ void kickProducer(int /*is*/) {
 void samplereader(void*) {
   rtaudioInit();
 
-  vlockAudio.lock();
-    vnumSamples = 960;
-    info("samplereader primed");
-  vlockAudio.unlock();
+  int csamp = 960;
+  vrateAudio = SR;
+  vcsampAhead = 2*csamp;
+  info("samplereader primed");
+  std::vector<short> buf(csamp);
 
   while (!vfQuit) {
-    vlockAudio.lock();
-	  const bool f = visSamples > 0;
-	  if (f) {
-		  rtaudioTick(vpsSamples, visSamples);
-		  //isKicked -= visSamples;
-		  //if (isKicked < 0) printf("whoa, producer, request more than that.\n");;;;
-		  visSamples = 0;
-		  vnumSamples = rtaudioBuf();
-	  }
-    vlockAudio.unlock();
-    snooze(f ? 0.001 : 0.015);
-	// In ALSA, 0.015 matched period_time=15000 usec.
-	// Here in RtAudio, 256 samples at 16 kHz is 0.016 seconds.
-	// Nope.  Alsa's snd_pcm_writei() is blocking.  But RtAudio no longer supports blocking writes.
-	// So rtaudioTick() returns immediately, whereas alsaTick() returned only after 15 msec.
-	// OLD: 0.015 is just too short: producer runs too fast.  0.025 is too long: producer runs too slow, dropouts.
+    buf.resize(std::max(csamp, 1));
+    const int c = int(vringAudio.read(&buf[0], csamp));
+    if (c > 0) {
+      rtaudioTick(&buf[0], c);
+      csamp = rtaudioBuf();
+    }
+    snooze(c > 0 ? 0.001 : 0.015);
+	// RtAudio no longer supports blocking writes, so rtaudioTick() returns immediately.
+	// Hence this snooze, unlike alsaTick(), which blocks.
   }
   rtaudioTerm();
 }
 
 #else
+// Called by alsaRun(), on the realtime audio thread.
+// Whatever samplewriter() has provided, padded with silence, so the soundcard never underruns.
+void fillFromRing(short* dst, const int csamp) {
+  if (vfFlushAudio) {
+    // Meanwhile samplewriter() waits.
+    (void)vringAudio.skip(vringAudio.readable());
+    vfFlushAudio = false;
+  }
+  const int c = int(vringAudio.read(dst, csamp));
+  std::fill(dst + c, dst + csamp, short(0));
+  wakeSamplewriter(); // Refill vringAudio while alsaRun() waits for the soundcard.
+}
+
 void* samplereader(void*) {
-  extern void alsaInit(unsigned), alsaTick(const short*, ssize_t), alsaTerm();
+  extern void alsaInit(unsigned), alsaRun(void (*)(short*, int), const bool&, std::atomic<bool>&), alsaTerm();
   extern int alsaBuf();
+  extern unsigned alsaRate();
   alsaInit(SR);
-
-  vlockAudio.lock();
-    vnumSamples = alsaBuf();
-    info("samplereader primed");
-  vlockAudio.unlock();
-
-  while (!vfQuit) {
-    vlockAudio.lock();
-      const bool f = visSamples>0;
-      if (f) {
-	// Send visSamples audio-samples to ALSA.
-	const ssize_t cb = visSamples*2;
-	alsaTick(vpsSamples, cb);
-	visSamples = 0;
-	// Underruns are ok.  So set vnumSamples instead of incrementing it.
-	vnumSamples = alsaBuf();
-      }
-    vlockAudio.unlock();
-    snooze(f ? 0.005 : 0.015);
-  }
-
+  // Enough to ride out a busy samplewriter().  Stopping flushes it, so it needn't be small.
+  vrateAudio = alsaRate();
+  vcsampAhead = std::min(std::max(2*alsaBuf(), int(alsaRate())/10), int(vringAudio.capacity()));
+  info("samplereader primed");
+  alsaRun(fillFromRing, vfQuit, vfRestartAudio);
   alsaTerm();
   return NULL;
 }
 #endif
 
-// If audio needs playing, report the next bufferful of samples
-// (from main memory) as {vpsSamples,visSamples}.
+// While audio is playing, copy samples from main memory into vringAudio,
+// stretching them to the playback speed and converting from SR to the soundcard's rate.
 #ifdef _MSC_VER
 void samplewriter(void*)
 #else
 void* samplewriter(void*)
 #endif
 {
+  Resampler* resampler = NULL; // Once samplereader() knows the soundcard's rate.
+  Wsola wsola(SR);
+  unsigned genPlay = vgenPlay;
+  std::vector<short> buf, bufIn;
   while (!vfQuit) {
-    while (!s2s.playing() && !vfQuit)
-      snooze(0.03); // much longer than that of than samplereader?
-    if (vfQuit)
-      break;
-    vlockAudio.lock();
-      if (vnumSamples > 0) {
-	s2s.emit(vnumSamples);
-	vnumSamples = 0;
+    // Never more than fits, so nothing pulled from the resampler is dropped.
+    const int cRoom = std::min(vcsampAhead - int(vringAudio.readable()), int(vringAudio.writable()));
+    if (cRoom > 0 && !resampler)
+      resampler = new Resampler(SR, vrateAudio);
+    if (genPlay != vgenPlay) {
+      genPlay = vgenPlay;
+      if (resampler)
+	resampler->reset(); // Don't blend in the end of the previous play.
+      wsola.reset();
+    }
+    if (resampler && cRoom > 0 && !vfFlushAudio && s2s.playing()) {
+      // If playback jumps after this, what's stretched and resampled is from the old place.
+      const unsigned genEmit = vgenPlay;
+      const int cIn = resampler->needed(cRoom);
+      if (cIn > 0) {
+	bufIn.resize(cIn);
+	const int c = s2s.emit(cIn, &bufIn[0], wsola);
+	resampler->push(&bufIn[0], c);
+      }
+      buf.resize(cRoom);
+      const int c = resampler->pull(&buf[0], cRoom);
+      if (genEmit != vgenPlay)
+	continue; // Drop it.  The top of the loop resets the resampler.
+      if (c > 0) {
+	// Only this thread writes, so the room it saw is still there.
+	if (vringAudio.write(&buf[0], c) != size_t(c))
+	  warn("samplewriter dropped audio");
+	continue;
       }
-    vlockAudio.unlock();
+    }
+    waitSamplewriter();
   }
+  delete resampler;
 #ifndef _MSC_VER
   return NULL;
 #endif
 }
 
+// A 1 kHz sine, resampled, stays within a couple of LSBs of the ideal,
+// fed through a ring like vringAudio as samplewriter() does, at rates up to 96 kHz.
+void testResampler()
+{
+#ifndef NDEBUG
+  const unsigned rates[][2] = { {44100, 48000}, {96000, 48000}, {16000, 44100}, {48000, 96000}, {96000, 96000} };
+  for (unsigned r=0; r<sizeof(rates)/sizeof(rates[0]); ++r) {
+    const unsigned rateIn = rates[r][0], rateOut = rates[r][1];
+    std::vector<short> in(rateIn / 5);
+    for (size_t i=0; i<in.size(); ++i)
+      in[i] = short(floor(10000.0 * sin(2.0*M_PI*1000.0*i/rateIn) + 0.5));
+    Resampler resampler(rateIn, rateOut);
+    RingBuffer<short, decltype(vringAudio)::capacity()> ring;
+    const int cAhead = std::min(std::max(2*1024, int(rateOut)/10), int(ring.capacity()));
+    std::vector<short> buf, out(1024);
+    size_t iIn = 0, cOut = 0;
+    double errMax = 0.0;
+    for (;;) {
+      const int cRoom = std::min(cAhead - int(ring.readable()), int(ring.writable()));
+      const int cIn = std::min(resampler.needed(cRoom), int(in.size() - iIn));
+      resampler.push(&in[iIn], cIn);
+      iIn += cIn;
+      buf.resize(std::max(cRoom, 1));
+      const int c = resampler.pull(&buf[0], cRoom);
+      const size_t cWritten = ring.write(&buf[0], c);
+      assert(cWritten == size_t(c));
+      (void)cWritten;
+      // The soundcard takes a period.
+      const size_t cRead = ring.read(&out[0], out.size());
+      if (cRead == 0 && c == 0)
+	break;
+      for (size_t i=0; i<cRead; ++i, ++cOut) {
+	const double t = double(cOut) / rateOut;
+	if (t > 0.01 && t < in.size() / double(rateIn) - 0.01)
+	  errMax = std::max(errMax, fabs(out[i] - 10000.0 * sin(2.0*M_PI*1000.0*t)));
+      }
+    }
+    // All of it, but the last few input samples that the filter still needs.
+    assert(errMax < 2.0);
+    assert(fabs(cOut - in.size() * double(rateOut) / rateIn) < 256);
+    (void)errMax;
+  }
+#endif
+}
+
 const char* dirMarshal = ".timeliner_marshal";
 
 #ifdef _MSC_VER
@@ -1686,6 +2038,7 @@ int main(int argc, char** argv)
 {
   appname = argv[0];
   testConverters();
+  testResampler();
 
 #ifndef _MSC_VER
   // Nvidia: prevent image tearing, and as a side effect limit fps to 60.
@@ -1720,8 +2073,7 @@ int main(int argc, char** argv)
   //printf("%ld frames, %d SR, %d channels, %x format, %d sections, %d seekable\n",
   //  long(sfinfo.frames), sfinfo.samplerate, sfinfo.channels, sfinfo.format, sfinfo.sections, sfinfo.seekable);
   SR = sfinfo.samplerate;
-  if (sfinfo.format != (SF_FORMAT_WAV|SF_FORMAT_PCM_16))
-    warn("wavfile has unexpected format");
+  // Whatever timeliner_pre's mixedformat was, libsndfile converts it to 16-bit samples.
   wavcsamp = long(sfinfo.frames);
   channels = sfinfo.channels;
   wavS16 = new short[wavcsamp * channels];
@@ -1770,6 +2122,8 @@ int main(int argc, char** argv)
   glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB);
   glutInitWindowSize(pixelSize[0], pixelSize[1]);
   glutCreateWindow("Timeliner");
+  glewInit(); // Before makeMipmaps, which may need glCompressedTexImage2D.
+  gpuBudget.init();
   glutKeyboardFunc(keyboard);
   glutMouseFunc(mouse);
   glutMotionFunc(drag);
@@ -1786,24 +2140,27 @@ int main(int argc, char** argv)
 
   glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 
+  // Low priority, because after startup it only prefetches.
+  pool = new WorkerPool(true);
+
   info("reading marshaled htk features");
-  // Ugly and brute-force.  Just let filenames fail if they don't exist.
-  int i;
-  char filename[10] = "features9";
-  for (i=9; i>=0; --i) {
-    filename[8] = char('0' + i);
-    Feature* f = new Feature(-1, filename, dirMarshal);
+  // Only their headers, for now.  drawFeatures() loads each one, i.e., caches and uploads it,
+  // when it's first onscreen.  Features load concurrently, sharing the pool.
+  const std::vector<MarshalEntry> manifest = readManifest(dirMarshal);
+  if (manifest.empty())
+    warn("No manifest in " + std::string(dirMarshal) + "; rerun timeliner_pre");
+  // Last listed is drawn lowest.
+  for (std::vector<MarshalEntry>::const_reverse_iterator it = manifest.rbegin(); it != manifest.rend(); ++it) {
+    if (!fShowFeature(*it))
+      continue;
+    Feature* f = new Feature(it->iColormap, it->filename, dirMarshal);
     if (f->fValid())
       features.push_back(f);
     else
       delete f;
   }
-  if (features.empty()) {
+  if (features.empty())
     warn("No HTK features");
-  }
-  else {
-    info("cached HTK features");
-  }
 
   shaderInit();
 
@@ -1815,6 +2172,7 @@ int main(int argc, char** argv)
   (void)_beginthread(samplewriter, 0, NULL);
   // todo: if (_threadID == (unsigned long)(-1L)) ...
 #else
+  (void)sem_init(&vsemAudio, 0, 0);
   pthread_t idDummy;
   pthread_create(&idDummy, NULL, &samplereader, NULL);
   pthread_create(&idDummy, NULL, &samplewriter, NULL);
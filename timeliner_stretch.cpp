@@ -0,0 +1,97 @@
+#include "timeliner_stretch.h"
+
+#include <algorithm>
+#include <cmath>
+
+Wsola::Wsola(const unsigned sr) :
+  _hop(std::max(16, int(sr * 0.02))),		// 20 ms, so frames are 40 ms
+  _tolerance(std::max(4, int(sr * 0.01))),	// 10 ms, about the period of the lowest voice
+  _window(2*_hop),
+  _tail(_hop),
+  _out(_hop)
+{
+  // Periodic Hann, so windows half a frame apart sum to exactly 1.
+  for (int i=0; i<2*_hop; ++i)
+    _window[i] = float(0.5 - 0.5 * cos(M_PI * i / _hop));
+  reset();
+}
+
+void Wsola::reset()
+{
+  std::fill(_tail.begin(), _tail.end(), 0.0f);
+  _iOut = _hop; // _out is used up.
+  _segPrev = -1;
+}
+
+// Where, within _tolerance of nominal, a segment's first half best matches
+// the second half of the previous segment's natural continuation.
+long Wsola::bestSegment(const short* src, const long csrc, const long nominal) const
+{
+  const long natural = _segPrev + _hop;
+  const long lo = std::max(0L, nominal - _tolerance);
+  const long hi = std::min(csrc - 2*_hop, nominal + _tolerance);
+  if (_segPrev < 0 || natural + _hop > csrc || lo > hi)
+    return nominal;
+
+  // Normalized cross-correlation.  Coarsely first, every other offset and every fourth sample,
+  // then at the best offset's neighbors.
+  const short* const a = src + natural;
+  long best = nominal;
+  float scoreBest = -1e30f;
+  for (int pass=0; pass<2; ++pass) {
+    const long d0 = pass == 0 ? lo : std::max(lo, best-1);
+    const long d1 = pass == 0 ? hi : std::min(hi, best+1);
+    const long dd = pass == 0 ? 2 : 1;
+    for (long d=d0; d<=d1; d+=dd) {
+      const short* const b = src + d;
+      float xy = 0.0f;
+      float yy = 1.0f;
+      for (int i=0; i<_hop; i+=4) {
+	xy += float(a[i]) * float(b[i]);
+	yy += float(b[i]) * float(b[i]);
+      }
+      const float score = xy / sqrtf(yy);
+      if (score > scoreBest) {
+	scoreBest = score;
+	best = d;
+      }
+    }
+  }
+  return best;
+}
+
+int Wsola::process(const short* src, const long csrc, double& pos, const double speed, short* dst, const int c)
+{
+  // Slower than this, a grain would just repeat, so fade to silence instead.
+  const double speedMin = 0.05;
+  int n = 0;
+  while (n < c) {
+    if (_iOut < _hop) {
+      const int k = std::min(c-n, _hop-_iOut);
+      std::copy(_out.begin() + _iOut, _out.begin() + _iOut + k, dst + n);
+      n += k;
+      _iOut += k;
+      continue;
+    }
+
+    // Next frame.
+    const long nominal = lround(pos);
+    if (nominal < 0 || nominal + 2*_hop > csrc)
+      break; // Off either end.
+    const long seg = fabs(speed) < speedMin ? -1 : bestSegment(src, csrc, nominal);
+    for (int i=0; i<_hop; ++i) {
+      float z = _tail[i];
+      if (seg >= 0) {
+	z += _window[i] * src[seg+i];
+	_tail[i] = _window[_hop+i] * src[seg+_hop+i];
+      } else {
+	_tail[i] = 0.0f;
+      }
+      _out[i] = short(std::max(-32768.0f, std::min(32767.0f, floorf(z + 0.5f))));
+    }
+    _iOut = 0;
+    _segPrev = seg;
+    pos += speed * _hop;
+  }
+  return n;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <vector>
+
+// Time-stretching for playback faster or slower than real time, without changing pitch.
+//
+// WSOLA, waveform similarity overlap-add:  each output frame is a Hann-windowed segment of the input,
+// overlapping the previous one by half.  The segment starts near where the playback speed says,
+// but within _tolerance of that it starts where it best matches how the previous segment would have continued,
+// so the overlap adds in phase instead of beating.
+// At speed 1, that's the input itself.  At negative speeds, grains play forwards but step backwards, for scrubbing.
+
+class Wsola {
+public:
+  Wsola(unsigned sr);
+
+  void reset(); // Forget the previous segment, e.g. when playback jumps elsewhere.
+
+  // Make c output samples from src[0..csrc), starting from input sample pos,
+  // and advance pos by about speed input samples per output sample.
+  // Returns how many it made, fewer than c only at either end of src.
+  int process(const short* src, long csrc, double& pos, double speed, short* dst, int c);
+
+private:
+  const int _hop;		// output samples per frame, half the frame
+  const int _tolerance;		// farthest a segment may start from its nominal position
+  std::vector<float> _window;	// Hann, 2*_hop
+  std::vector<float> _tail;	// Windowed second half of the previous segment, to overlap the next one.
+  std::vector<short> _out;	// Output of the latest frame, _hop samples.
+  int _iOut;			// How much of _out has been returned.
+  long _segPrev;		// Where the previous segment started in src, or -1.
+
+  long bestSegment(const short* src, long csrc, long nominal) const;
+};
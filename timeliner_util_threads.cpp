@@ -3,144 +3,552 @@
 #include "timeliner_util_threads.h"
 #include "timeliner_util.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cctype>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <string>
+#include <time.h>
 #include <unistd.h>
 
 // Pool of worker threads, e.g. for computing mipmaps.
 
-int WorkerPool::cores()
+// A logical CPU, i.e. a hyperthread.
+class Cpu {
+public:
+  int cpu;
+  int node;	// NUMA
+  int package;	// socket
+  int core;	// within the package
+  bool operator<(const Cpu& r) const {
+    if (node    != r.node)    return node    < r.node;
+    if (package != r.package) return package < r.package;
+    if (core    != r.core)    return core    < r.core;
+    return cpu < r.cpu;
+  }
+};
+
+#ifdef __linux__
+int intFromFile(const std::string& filename, const int valDefault) {
+  FILE* fp = fopen(filename.c_str(), "r");
+  if (!fp)
+    return valDefault;
+  int val;
+  if (fscanf(fp, "%d", &val) != 1)
+    val = valDefault;
+  fclose(fp);
+  return val;
+}
+
+// Linux lists a CPU's NUMA node as a subdirectory nodeN.  Without NUMA, 0.
+int nodeOfCpu(const int cpu) {
+  DIR* dir = opendir(("/sys/devices/system/cpu/cpu" + std::to_string(cpu)).c_str());
+  if (!dir)
+    return 0;
+  int node = 0;
+  for (const dirent* e; (e = readdir(dir)); ) {
+    if (strncmp(e->d_name, "node", 4) == 0 && isdigit(e->d_name[4])) {
+      node = atoi(e->d_name + 4);
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+#endif
+
+// One worker per physical core that this process may use, grouped by NUMA node.
+void WorkerPool::placeWorkers()
 {
-  //return 1; // for debugging
-  // POSIX:
+  std::vector<Cpu> cpus;
+#ifdef __linux__
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu=0; cpu<CPU_SETSIZE; ++cpu) {
+      if (!CPU_ISSET(cpu, &set))
+	continue;
+      const std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+      const Cpu c = { cpu, nodeOfCpu(cpu), intFromFile(dir + "physical_package_id", 0), intFromFile(dir + "core_id", cpu) };
+      bool fHyperthread = false;
+      for (std::vector<Cpu>::const_iterator it = cpus.begin(); it != cpus.end(); ++it)
+	fHyperthread |= it->package == c.package && it->core == c.core;
+      if (!fHyperthread)
+	cpus.push_back(c);
+    }
+    std::sort(cpus.begin(), cpus.end());
+  }
+#endif
+  if (cpus.empty()) {
+    // Topology unknown, so count hyperthreads, unpinned.
+    int n = 1;
+    // POSIX:
 #if defined(_SC_NPROC_ONLN)
-  return sysconf(_SC_NPROC_ONLN);
+    n = sysconf(_SC_NPROC_ONLN);
 #elif defined(_SC_NPROCESSORS_ONLN)
-  return sysconf(_SC_NPROCESSORS_ONLN);
-#else
-  return 1;
+    n = sysconf(_SC_NPROCESSORS_ONLN);
 #endif
-  // Alternatives:
-  // gcc's get_nprocs(),
-  // http://stackoverflow.com/questions/12483399/getting-number-of-cores-not-ht-threads
+    for (int i=0; i<std::max(n, 1); ++i) {
+      const Cpu c = { -1, 0, 0, i };
+      cpus.push_back(c);
+    }
+  }
+  _cores = cpus.size();
+  //_cores = 1; // for debugging
+
+  const char* pch = getenv("timeliner_pin");
+  const bool fPin = pch && *pch && strcmp(pch, "0") != 0;
+  _rgcpu.resize(_cores);
+  for (int i=0; i<_cores; ++i)
+    _rgcpu[i] = fPin ? cpus[i].cpu : -1;
+  if (fPin)
+    printf("Pinned %d worker threads to cores.\n", _cores);
+
+  // Unpinned threads migrate, so then their nodes mean nothing.
+  _rgvictims.resize(_cores);
+  for (int i=0; i<_cores; ++i) {
+    std::vector<int>& v = _rgvictims[i];
+    for (int k=1; k<_cores; ++k) {
+      const int victim = (i + k) % _cores; // Start at different victims, to spread the stealing.
+      if (!fPin || cpus[victim].node == cpus[i].node)
+	v.push_back(victim);
+    }
+    for (int k=1; fPin && k<_cores; ++k) {
+      const int victim = (i + k) % _cores;
+      if (cpus[victim].node != cpus[i].node)
+	v.push_back(victim);
+    }
+  }
+  _rgnodeWorkers.clear();
+  for (int i=0; i<_cores; ++i) {
+    if (i == 0 || (fPin && cpus[i].node != cpus[i-1].node))
+      _rgnodeWorkers.push_back(std::vector<int>());
+    _rgnodeWorkers.back().push_back(i);
+  }
+}
+
+// A worker for the k'th of several independent jobs, spreading them across NUMA nodes.
+int WorkerPool::home(const unsigned k) const {
+  const std::vector<int>& node = _rgnodeWorkers[k % _rgnodeWorkers.size()];
+  return node[(k / _rgnodeWorkers.size()) % node.size()];
 }
 
 bool WorkerPool::empty() const {
-  if (!queueArgs.empty())
+  pthread_mutex_lock(&_mutex);
+  const bool f = _cPending == 0;
+  pthread_mutex_unlock(&_mutex);
+  return f;
+}
+
+size_t WorkerPool::backlog() const {
+  pthread_mutex_lock(&_mutex);
+  const size_t c = _cQueued;
+  pthread_mutex_unlock(&_mutex);
+  return c;
+}
+
+void WorkerPool::Deque::push(const TaskHandle& h) {
+  pthread_mutex_lock(&_mutex);
+  _q.push_back(h);
+  pthread_mutex_unlock(&_mutex);
+}
+
+TaskHandle WorkerPool::Deque::popBack() {
+  TaskHandle h;
+  pthread_mutex_lock(&_mutex);
+  if (!_q.empty()) {
+    h = _q.back();
+    _q.pop_back();
+  }
+  pthread_mutex_unlock(&_mutex);
+  return h;
+}
+
+TaskHandle WorkerPool::Deque::popFront() {
+  TaskHandle h;
+  pthread_mutex_lock(&_mutex);
+  if (!_q.empty()) {
+    h = _q.front();
+    _q.pop_front();
+  }
+  pthread_mutex_unlock(&_mutex);
+  return h;
+}
+
+// Which worker of which pool the calling thread is.
+thread_local const WorkerPool* tlsPool = NULL;
+thread_local int tlsWorker = -1;
+thread_local TaskState* tlsTask = NULL; // What it's running.
+
+int WorkerPool::iWorker() const {
+  return tlsPool == this ? tlsWorker : -1;
+}
+
+// Highest priority first.  Within that,
+// own deque's newest, else the shared FIFO's oldest, else steal another worker's oldest, nearest first.
+TaskHandle WorkerPool::take(const int i) {
+  TaskHandle h;
+  for (int p=0; !h && p<priorities; ++p) {
+    if (i >= 0)
+      h = _rgdeque[i*priorities + p].popBack();
+    if (!h)
+      h = _shared[p].popFront();
+    if (i >= 0) {
+      const std::vector<int>& victims = _rgvictims[i];
+      for (std::vector<int>::const_iterator it = victims.begin(); !h && it != victims.end(); ++it)
+	h = _rgdeque[*it*priorities + p].popFront();
+    } else {
+      for (int victim=0; !h && victim<_cores; ++victim)
+	h = _rgdeque[victim*priorities + p].popFront();
+    }
+  }
+  if (h) {
+    pthread_mutex_lock(&_mutex);
+    --_cQueued;
+    pthread_mutex_unlock(&_mutex);
+  }
+  return h;
+}
+
+// Call with _mutex locked.
+void WorkerPool::enqueue(const TaskHandle& h) {
+  if (h->_fMain) {
+    _main[h->_priority].push(h);
+    ++_cEvents;
+    pthread_cond_broadcast(&_cvDone);
+    return;
+  }
+  ++_cQueued;
+  const int i = iWorker();
+  if (h->_home >= 0)
+    _rgdeque[h->_home*priorities + h->_priority].push(h); // Any worker will steal it, if that one's busy.
+  else if (i >= 0)
+    _rgdeque[i*priorities + h->_priority].push(h); // Spawned by a task, or made ready by one.
+  else
+    _shared[h->_priority].push(h);
+  pthread_cond_signal(&_cvTask);
+  if (_cWaiting > 0) {
+    // A task waiting in waitWorker() may run it.
+    ++_cEvents;
+    pthread_cond_broadcast(&_cvDone);
+  }
+}
+
+void WorkerPool::run(const TaskHandle& h) {
+  pthread_mutex_lock(&_mutex);
+  if (_fQuit)
+    h->_fCancelled = true;
+  h->_fStarted = true; // Too late for cancel().
+  pthread_mutex_unlock(&_mutex);
+  if (h->cancelled()) {
+    h->_task->abandon();
+  } else {
+    TaskState* const tlsPrev = tlsTask; // Nonnull if a task waiting for its subtasks runs this.
+    tlsTask = h.get();
+    h->_task->work();
+    tlsTask = tlsPrev;
+  }
+  delete h->_task;
+  h->_task = NULL;
+  pthread_mutex_lock(&_mutex);
+  if (h->_fGaveUp)
+    h->_fCancelled = true;
+  h->_fDone = true;
+  --_cPending;
+  for (TaskHandles::iterator it = h->_dependents.begin(); it != h->_dependents.end(); ++it) {
+    if (h->cancelled())
+      (*it)->_fCancelled = true; // Its input is missing.
+    if (--(*it)->_cDeps == 0)
+      enqueue(*it);
+  }
+  h->_dependents.clear();
+  ++_cEvents;
+  pthread_cond_broadcast(&_cvDone);
+  pthread_mutex_unlock(&_mutex);
+}
+
+bool WorkerPool::runOne() {
+  const TaskHandle h = take(iWorker());
+  if (!h)
     return false;
-  arGuard _(_lock);
-  for (int i=0; i<_cores; ++i)
-    if (_busy[i])
-      return false;
+  run(h);
   return true;
 }
 
-const int usecSleepMax = 50000;
+double secondsMonotonic() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
 
-void WorkerArgs::work() const {
-  _feature.makeTextureMipmapChunk(_cacheHTK, _mipmaplevel, _width, _ichunk);
+TaskHandle WorkerPool::takeMain() {
+  TaskHandle h;
+  for (int p=0; !h && p<priorities; ++p)
+    h = _main[p].popFront();
+  return h;
 }
 
-void* WorkerPool::workerThread(void* pv) {
-  const int i = *(int*)pv;
-  bool& fBusy = _busy[i];
-  { arGuard _(_lock); fBusy = false; } // Report myself as available.
-
-  while (!_fQuit) {
-    usleep(usecSleepMax);
-    bool f; { arGuard _(_lock); f = fBusy; }
-    if (f) {
-      // placeholder to run the task
-      const WorkerArgs* args = _args[i];
-      printf("worker %d starting task %d %d\n", i, args->_feature.vectorsize(), args->_width);
-      args->work();
-      //printf("worker %d finished task %d %d\n", i, args->_vectorsize, args->_width);
-      delete args;
-      { arGuard _(_lock); fBusy = false; } // Report myself as available.
+void WorkerPool::runMain(const double secsMax) {
+  assert(iWorker() < 0);
+  const double t0 = secondsMonotonic();
+  std::deque<TaskHandle> postponed[priorities];
+  for (;;) {
+    const TaskHandle h = takeMain();
+    if (!h)
+      break;
+    if (!h->cancelled() && !h->_task->fReady()) {
+      postponed[h->_priority].push_back(h);
+      continue;
     }
-    if (fBusy)
-      printf("worker %d just became busy\n", i);
-    else
-      printf("worker %d idle\n", i);
+    run(h); // This may make more tasks ready for _main.
+    if (secondsMonotonic() - t0 > secsMax)
+      break;
+  }
+  for (int p=0; p<priorities; ++p) {
+    if (postponed[p].empty())
+      continue;
+    // Back to the front, in order.
+    Deque& d = _main[p];
+    pthread_mutex_lock(&d._mutex);
+    d._q.insert(d._q.begin(), postponed[p].begin(), postponed[p].end());
+    pthread_mutex_unlock(&d._mutex);
+  }
+}
+
+// If it's already started, only ask it to stop, so cancelled() means abandoned or given up, not merely requested.
+void WorkerPool::cancel(const TaskHandle& h) {
+  if (!h)
+    return;
+  pthread_mutex_lock(&_mutex);
+  if (!h->_fStarted)
+    h->_fCancelled = true;
+  else if (!h->_fDone)
+    h->_fStop = true;
+  pthread_mutex_unlock(&_mutex);
+}
+
+bool WorkerPool::stopRequested() {
+  if (!tlsTask || !(tlsTask->_fStop || (tlsPool && tlsPool->_fQuit)))
+    return false;
+  tlsTask->_fGaveUp = true;
+  return true;
+}
+
+// From the main thread, until h is done, or if h is NULL until everything is done,
+// or if cbAdmit is nonzero until that many bytes are admitted.
+// Meanwhile, run tasks for the main thread.
+void WorkerPool::waitMain(const TaskHandle* h, const long cbAdmit) {
+  for (;;) {
+    pthread_mutex_lock(&_mutex);
+    const unsigned events = _cEvents;
+    pthread_mutex_unlock(&_mutex);
+    runMain(1e9);
+    pthread_mutex_lock(&_mutex);
+    for (;;) {
+      if (cbAdmit > 0 ? fAdmits(cbAdmit) : h ? (*h)->done() : _cPending == 0) {
+	if (cbAdmit > 0)
+	  _cbInFlight += cbAdmit;
+	pthread_mutex_unlock(&_mutex);
+	return;
+      }
+      if (_cEvents != events)
+	break; // Maybe more for runMain.
+      pthread_cond_wait(&_cvDone, &_mutex);
+    }
+    pthread_mutex_unlock(&_mutex);
+  }
+}
+
+void WorkerPool::wait() {
+  assert(iWorker() < 0); // A task would deadlock.  Instead, it should wait() for its subtasks.
+  waitMain(NULL);
+}
+
+void WorkerPool::wait(const TaskHandle& h) {
+  if (iWorker() < 0) {
+    waitMain(&h);
+    return;
+  }
+  waitWorker(&h);
+}
+
+// From a task, until h is done, or if cbAdmit is nonzero until that many bytes are admitted.
+// Meanwhile, it helps by running other tasks, instead of blocking a worker.
+// When there are none to run, it sleeps until one is queued or something finishes.
+void WorkerPool::waitWorker(const TaskHandle* h, const long cbAdmit) {
+  for (;;) {
+    if (cbAdmit > 0 ? tryAdmit(cbAdmit) : (*h)->done())
+      return;
+    if (runOne())
+      continue;
+    pthread_mutex_lock(&_mutex);
+    ++_cWaiting;
+    while (_cQueued == 0 && !(cbAdmit > 0 ? fAdmits(cbAdmit) : (*h)->done()))
+      pthread_cond_wait(&_cvDone, &_mutex);
+    --_cWaiting;
+    pthread_mutex_unlock(&_mutex);
   }
+}
+
+// Call with _mutex locked.
+// Anything fits when nothing's in flight, lest a huge request wait forever.
+bool WorkerPool::fAdmits(const long cb) const {
+  return _cbInFlight == 0 || _cbInFlight + cb <= _cbInFlightMax;
+}
+
+bool WorkerPool::tryAdmit(const long cb) {
+  pthread_mutex_lock(&_mutex);
+  const bool f = fAdmits(cb);
+  if (f)
+    _cbInFlight += cb;
+  pthread_mutex_unlock(&_mutex);
+  return f;
+}
+
+void WorkerPool::admit(const long cb) {
+  if (cb <= 0 || tryAdmit(cb))
+    return;
+  if (iWorker() < 0) {
+    waitMain(NULL, cb);
+    return;
+  }
+  waitWorker(NULL, cb);
+}
+
+void WorkerPool::release(const long cb) {
+  pthread_mutex_lock(&_mutex);
+  _cbInFlight -= cb;
+  assert(_cbInFlight >= 0);
+  ++_cEvents;
+  pthread_cond_broadcast(&_cvDone);
+  pthread_mutex_unlock(&_mutex);
+}
+
+void* WorkerPool::workerThread(void* pv) {
+  WorkerPool& pool = *(WorkerPool*)pv;
+  pthread_mutex_lock(&pool._mutex);
+  const int i = pool._cStarted++;
+  pthread_mutex_unlock(&pool._mutex);
+  tlsPool = &pool;
+  tlsWorker = i;
+  pool.workerLoop(i);
   return NULL;
 }
 
-int WorkerPool::getWorker(const WorkerArgs* args) {
-  arGuard _(_lock);
-  for (int i=0; i<_cores; ++i) {
-    if (!_busy[i]) {
-      _busy[i] = true;
-      // Give the worker this task.
-      _args[i] = args;
-      printf("recruited worker %d\n", i);
-      return i;
+void WorkerPool::workerLoop(const int i) {
+#ifdef __linux__
+  if (_rgcpu[i] >= 0) {
+    // Then what this worker allocates and first touches is on its own node.
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(_rgcpu[i], &set);
+    if (0 != pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+      warn("failed to pin worker thread");
+  }
+#endif
+#if defined(__linux__) && defined(SCHED_IDLE)
+  if (_fLowPriority) {
+    // Yield to the GLUT thread and the audio threads.
+    const sched_param param = {0};
+    (void)pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+  }
+#endif
+  for (;;) {
+    const TaskHandle h = take(i);
+    if (h) {
+      run(h);
+      continue;
     }
+    pthread_mutex_lock(&_mutex);
+    while (_cQueued == 0 && !_fQuit)
+      pthread_cond_wait(&_cvTask, &_mutex);
+    const bool fDone = _cQueued == 0; // _fQuit, and nothing left to start.
+    pthread_mutex_unlock(&_mutex);
+    if (fDone)
+      break;
   }
-  return -1;
 }
 
-void* WorkerPool::taskWorker(void*) {
-  while (!_fQuit) {
-    if (queueArgs.empty()) {
-      usleep(usecSleepMax/5);
-    } else {
-      const WorkerArgs* args = queueArgs.front();
-      queueArgs.pop();
-      printf("\t\t\t\tsize %lu;\t\tawaiting idle worker for %d %d\n", queueArgs.size(), args->_feature.vectorsize(), args->_width);
-      // Wait for a worker for task "args".
-      while (getWorker(args) < 0)
-	usleep(usecSleepMax/5);
+TaskHandle WorkerPool::submit(Task* t, const bool fMain, const TaskHandles& deps, const int priority, const int home) {
+  assert(0 <= priority && priority < priorities);
+  assert(home < _cores);
+  const TaskHandle h(new TaskState(t, fMain, priority, home));
+  pthread_mutex_lock(&_mutex);
+  for (TaskHandles::const_iterator it = deps.begin(); it != deps.end(); ++it) {
+    if (!*it)
+      continue;
+    if (!(*it)->done()) {
+      ++h->_cDeps;
+      (*it)->_dependents.push_back(h);
+    } else if ((*it)->cancelled()) {
+      h->_fCancelled = true;
     }
   }
-  return NULL;
+  ++_cPending;
+  if (h->_cDeps == 0)
+    enqueue(h);
+  pthread_mutex_unlock(&_mutex);
+  return h;
 }
 
-// Assign tasks to workers in order received, for better memory locality.
-void WorkerPool::task(WorkerArgs* args) {
-  queueArgs.push(args);
-  printf("\t\t\t\tsize %lu;\t\tqueued task %d %d\n", queueArgs.size(), args->_feature.vectorsize(), args->_width);
+TaskHandle WorkerPool::task(Task* t, const TaskHandles& deps, const int priority, const int home) {
+  return submit(t, false, deps, priority, home);
 }
 
-WorkerPool::WorkerPool()
+TaskHandle WorkerPool::taskMain(Task* t, const TaskHandles& deps, const int priority) {
+  return submit(t, true, deps, priority, -1);
+}
+
+// fLowPriority for background work like prefetching, which mustn't delay drawing or audio.
+WorkerPool::WorkerPool(bool fLowPriority) :
+  _fQuit(false),
+  _fLowPriority(fLowPriority),
+  _cQueued(0),
+  _cPending(0),
+  _cStarted(0),
+  _cEvents(0),
+  _cWaiting(0),
+  _cbInFlight(0)
 {
-  // Create _cores threads.
-  _fQuit = false;
-  _cores = cores();
+  // Bound in-flight bytes by the environment variable timeliner_poolmb, else by a quarter of RAM.
+  const char* pch = getenv("timeliner_poolmb");
+  _cbInFlightMax = pch ? long(atof(pch) * 1e6) : 0;
+  if (_cbInFlightMax <= 0) {
+#if defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+    _cbInFlightMax = long(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGESIZE) / 4;
+#endif
+    if (_cbInFlightMax <= 0)
+      _cbInFlightMax = 1L << 30;
+  }
+
+  pthread_mutex_init(&_mutex, NULL);
+  pthread_cond_init(&_cvTask, NULL);
+  pthread_cond_init(&_cvDone, NULL);
+  placeWorkers();
+  _rgdeque = new Deque[_cores * priorities];
   _rgworker = new pthread_t[_cores];
-  _rgiWorker = new int[_cores];
-  _args = new const WorkerArgs*[_cores];
-  _busy = new bool[_cores];
   for (int i=0; i<_cores; ++i) {
-    _rgiWorker[i] = i;
-    if (0 != pthread_create(&_rgworker[i] , NULL, &workerThread, &_rgiWorker[i]))
+    if (0 != pthread_create(&_rgworker[i], NULL, &workerThread, this))
       quit("failed to create pool of worker threads");
   }
-  if (0 != pthread_create(&_queueHandler, NULL, &taskWorker, NULL))
-    quit("failed to init worker thread queue-handler");
 }
 
 WorkerPool::~WorkerPool()
 {
-  while (!empty())
-    usleep(usecSleepMax/2);
-  // Workers are idle and queue is empty.
+  pthread_mutex_lock(&_mutex);
   _fQuit = true;
+  pthread_cond_broadcast(&_cvTask);
+  pthread_mutex_unlock(&_mutex);
+  // Workers empty the queue, abandoning what hasn't started, before they notice _fQuit.
   for (int i=0; i<_cores; ++i)
-    (void)pthread_cancel(_rgworker[i]);
-  (void)pthread_cancel(_queueHandler);
-  usleep(usecSleepMax*2); // give threads time to notice _fQuit, in case pthread_cancel() failed
+    (void)pthread_join(_rgworker[i], NULL);
   delete [] _rgworker;
-  delete [] _rgiWorker;
-  delete [] _args;
-  delete [] _busy;
+  delete [] _rgdeque;
+  pthread_cond_destroy(&_cvDone);
+  pthread_cond_destroy(&_cvTask);
+  pthread_mutex_destroy(&_mutex);
 }
-
-arLock WorkerPool::_lock;
-int WorkerPool::_cores = -1;
-bool WorkerPool::_fQuit = false;
-bool* WorkerPool::_busy = NULL;
-const WorkerArgs** WorkerPool::_args = NULL;
-std::queue<const WorkerArgs*> WorkerPool::queueArgs;
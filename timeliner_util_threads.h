@@ -4,9 +4,9 @@
 #include <windows.h>
 #endif
 
+#include "timeliner_diagnostics.h"
 #include <cerrno>
 #include <iostream>
-#include <queue>
 
 #ifdef _MSC_VER
 #include <process.h>
@@ -160,49 +160,140 @@ public:
   ~arGuard() { _l.unlock(); }
 };
 
-class CHello; // timeliner_cache.h
-#include "timeliner_feature.h" // class Feature
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <vector>
 
-class WorkerArgs {
+// What a WorkerPool runs.
+class Task {
 public:
-  const Feature& _feature;
-  const CHello& _cacheHTK;
-  const int _mipmaplevel;
-  const int _width;
-  const int _ichunk;
-  WorkerArgs( const Feature& feature, const CHello& cacheHTK, int mipmaplevel, int width, int ichunk ):
-    _feature(feature),
-    _cacheHTK(cacheHTK),
-    _mipmaplevel(mipmaplevel),
-    _width(width),
-    _ichunk(ichunk)
-    {}
-  void work() const;
+  virtual ~Task() {}
+  virtual void work() const = 0;
+  // For tasks run by runMain:  false postpones it to the next runMain.
+  virtual bool fReady() const { return true; }
+  // Instead of work(), if cancelled before starting, e.g. to free what work() would have.
+  virtual void abandon() const {}
 };
 
+// A submitted task's progress, shared by the pool and whoever submitted it.
+class TaskState {
+  friend class WorkerPool;
+  const Task* _task;
+  const bool _fMain;	// Run by runMain(), not by a worker.
+  const int _priority;
+  const int _home;	// Worker whose deque it starts in, or -1.
+  int _cDeps;		// Unfinished tasks that this one waits for.
+  bool _fStarted;	// work() or abandon() has begun.  Guarded like _cDeps.
+  std::atomic<bool> _fDone;
+  std::atomic<bool> _fCancelled;
+  std::atomic<bool> _fStop;	// cancel() came after it started.
+  bool _fGaveUp;	// work() saw stopRequested(), so its output is incomplete.  Only its thread touches this.
+  std::vector<std::shared_ptr<TaskState> > _dependents; // Tasks waiting for this one.
+public:
+  TaskState(const Task* t, bool fMain, int priority, int home) :
+    _task(t), _fMain(fMain), _priority(priority), _home(home), _cDeps(0), _fStarted(false), _fDone(false), _fCancelled(false), _fStop(false), _fGaveUp(false) {}
+  bool done() const { return _fDone; }
+  bool cancelled() const { return _fCancelled; } // Abandoned, or will be, instead of run.  Or it gave up partway.
+};
+typedef std::shared_ptr<TaskState> TaskHandle;
+typedef std::vector<TaskHandle> TaskHandles;
+
+// Work-stealing pool.
+// Tasks from other threads go into a shared FIFO, so they start in the order received.
+// Tasks spawned by a task go into its worker's own deque, which it pops LIFO (depth first, cache warm)
+// while idle workers steal from its other end.
+// Idle workers sleep on a condition variable, and wake as soon as a task arrives.
+//
+// A task starts only after the tasks it depends on have finished.
+// A task for the main thread, e.g. anything calling OpenGL, is run by that thread's calls to runMain() or wait().
+//
+// Among ready tasks, a higher priority one starts first, so onscreen chunks overtake background ones.
+// Tasks are short, so that's soon enough without preempting a running one.
+// A cancelled task gets abandon() instead of work(), and so do its dependents.
+// Cancelling a task that has already started only asks it to stop:  a long one may poll stopRequested(),
+// and if that returns true, give up at once.  Then it and its dependents are cancelled() too.
+// A task that never polls, or polls too late, runs to completion and isn't cancelled().
+//
+// There's one worker per physical core, ignoring hyperthreads, which share a core's caches.
+// If the environment variable timeliner_pin is set, each worker is pinned to its core,
+// and workers on the same NUMA node are adjacent.  An idle worker steals first from its own node.
+// A task given a home worker, e.g. the one that built what the task reads, starts in that worker's deque,
+// so on a multi-socket machine it usually runs on the node that holds its data.
+//
+// Each program has just one pool, shared by everything.
+// To keep many tasks from exhausting RAM, whoever submits a task that holds a big buffer
+// first admit()s those bytes, and the task release()s them when it frees the buffer.
 class WorkerPool {
 public:
-  WorkerPool();
-  ~WorkerPool();
-  void task(WorkerArgs*);
+  enum { priorityHigh, priorityNormal, priorityLow, priorities };
+
+  WorkerPool(bool fLowPriority = false);
+  ~WorkerPool(); // Finishes running tasks, and abandons the rest, except those for the main thread.
+  TaskHandle task    (Task*, const TaskHandles& deps = TaskHandles(), int priority = priorityNormal, int home = -1); // From any thread, including from within a task.
+  TaskHandle taskMain(Task*, const TaskHandles& deps = TaskHandles(), int priority = priorityNormal);
+  void cancel(const TaskHandle&); // From any thread.
+  static bool stopRequested(); // From within a task:  should it give up?  If true, it must.
+  void wait(); // Until all tasks are finished.  Only from the main thread.
+  void wait(const TaskHandle&); // From any thread.
+  bool runOne(); // Run a queued task, if any.  For a task waiting on its subtasks.
+  void runMain(double secsMax); // Run ready tasks for the main thread, for about that long.
   bool empty() const;
+  size_t backlog() const; // Tasks ready for a worker but not yet started.
+
+  void admit(long cb); // Wait until cb more bytes fit, meanwhile running tasks.
+  bool tryAdmit(long cb); // Or don't wait.
+  void release(long cb);
+
+  int iWorker() const; // Calling thread's index, or -1 if not this pool's.
+  int workers() const { return _cores; }
+  int home(unsigned k) const; // A home worker for the k'th of several jobs.
 
 private:
-  // Methods are static, to be usable from pthreads.
-  // Members are static for access from these static methods.
-  pthread_t _queueHandler;
+  class Deque {
+  public:
+    pthread_mutex_t _mutex;
+    std::deque<TaskHandle> _q;
+    Deque() { pthread_mutex_init(&_mutex, NULL); }
+    ~Deque() { pthread_mutex_destroy(&_mutex); }
+    void push(const TaskHandle&);
+    TaskHandle popBack();
+    TaskHandle popFront();
+  };
+
+  int _cores;		// workers
+  std::vector<int> _rgcpu;	// per worker, its core if pinned, else -1
+  std::vector<std::vector<int> > _rgvictims; // per worker, others to steal from, same NUMA node first
+  std::vector<std::vector<int> > _rgnodeWorkers; // per NUMA node if pinned, its workers
+  std::atomic<bool> _fQuit;
+  const bool _fLowPriority;
   pthread_t* _rgworker;
-  int* _rgiWorker;
-  static int _cores;
-  static bool _fQuit;
-  static bool* _busy;
-  static const WorkerArgs** _args;
-  static arLock _lock; // guards _busy and _args
-  static std::queue<const WorkerArgs*> queueArgs;
-
-  int cores();
-
-  static int getWorker(const WorkerArgs* args);
-  static void* taskWorker(void*);
+  // One of each per priority.
+  Deque _shared[priorities]; // from other threads
+  Deque* _rgdeque;	// per worker, [iWorker*priorities + priority]
+  Deque _main[priorities]; // for the main thread
+  mutable pthread_mutex_t _mutex; // guards the rest, and TaskStates' _cDeps and _dependents
+  int _cQueued;		// in _shared or _rgdeque
+  int _cPending;	// submitted but unfinished
+  int _cStarted;	// workers that have claimed an index
+  unsigned _cEvents;	// Times _cvDone was signaled.
+  int _cWaiting;	// tasks asleep in waitWorker()
+  long _cbInFlight;	// admitted but not yet released
+  long _cbInFlightMax;
+  pthread_cond_t _cvTask; // _cQueued grew, or _fQuit
+  pthread_cond_t _cvDone; // A task finished, or a task for the main thread became ready, or bytes were released,
+			  // or, if _cWaiting, a task was queued.
+
+  void placeWorkers();
+  TaskHandle submit(Task*, bool fMain, const TaskHandles& deps, int priority, int home);
+  void enqueue(const TaskHandle&);
+  TaskHandle take(int iWorker);
+  TaskHandle takeMain();
+  void run(const TaskHandle&);
+  void waitMain(const TaskHandle*, long cbAdmit = 0);
+  void waitWorker(const TaskHandle*, long cbAdmit = 0);
+  bool fAdmits(long cb) const;
+
   static void* workerThread(void*);
+  void workerLoop(int iWorker);
 };
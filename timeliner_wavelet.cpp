@@ -0,0 +1,56 @@
+#include "timeliner_wavelet.h"
+
+#include <cassert>
+#include <cmath>
+
+Wavelet::Wavelet(const int n) : _n(n), _s(n/2 * lanes), _d(n/2 * lanes)
+{
+  assert(n >= 4 && (n & (n-1)) == 0);
+}
+
+// Each level splits the first n rows into even rows e and odd rows o, m=n/2 of each, periodically extended.
+// GSL's centered D4 filters h and g make
+//   smooth[i] =  h0 e[i-1] + h1 o[i-1] + h2 e[i] + h3 o[i]
+//   detail[i] =  h3 e[i-1] - h2 o[i-1] + h1 e[i] - h0 o[i]
+// which factor into Sweldens's lifting steps
+//   s[i] = e[i] + sqrt3 o[i]
+//   d[i] = o[i] - sqrt3/4 s[i] - (sqrt3-2)/4 s[i-1]
+//   smooth[i] =  (sqrt3-1)/sqrt2 (s[i-1] - d[i])
+//   detail[i] = -(sqrt3+1)/sqrt2 d[i]
+// at half the multiplies of the filters.
+void Wavelet::operator()(float* x)
+{
+  const float r3 = sqrtf(3.0f);
+  const float p1 = r3 / 4.0f;
+  const float p2 = (r3 - 2.0f) / 4.0f;
+  const float ks = (r3 - 1.0f) / sqrtf(2.0f);
+  const float kd = -(r3 + 1.0f) / sqrtf(2.0f);
+  for (int n=_n; n>=2; n/=2) {
+    const int m = n/2;
+    for (int i=0; i<m; ++i) {
+      const float* __restrict e = x + (2*i) * lanes;
+      const float* __restrict o = x + (2*i+1) * lanes;
+      float* __restrict s = &_s[i * lanes];
+      for (int l=0; l<lanes; ++l)
+	s[l] = e[l] + r3 * o[l];
+    }
+    for (int i=0; i<m; ++i) {
+      const float* __restrict o = x + (2*i+1) * lanes;
+      const float* __restrict s = &_s[i * lanes];
+      const float* __restrict sPrev = &_s[((i+m-1) % m) * lanes];
+      float* __restrict d = &_d[i * lanes];
+      for (int l=0; l<lanes; ++l)
+	d[l] = o[l] - p1 * s[l] - p2 * sPrev[l];
+    }
+    for (int i=0; i<m; ++i) {
+      const float* __restrict sPrev = &_s[((i+m-1) % m) * lanes];
+      const float* __restrict d = &_d[i * lanes];
+      float* __restrict smooth = x + i * lanes;
+      float* __restrict detail = x + (m+i) * lanes;
+      for (int l=0; l<lanes; ++l) {
+	smooth[l] = ks * (sPrev[l] - d[l]);
+	detail[l] = kd * d[l];
+      }
+    }
+  }
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <vector>
+
+// Daubechies-4 wavelet transform, as GSL's gsl_wavelet_transform_forward computed it
+// with gsl_wavelet_daubechies_centered 4 and the same coefficient layout:
+// the coarsest smooth coefficient, then each level's details from coarsest to finest.
+//
+// Transforms lanes windows at once.  Their samples are interleaved, [sample][lane],
+// so each lifting step's inner loop is unit-stride across windows and the compiler vectorizes it.
+class Wavelet {
+public:
+  enum { lanes = 8 };
+  Wavelet(int n);				// n samples per window, a power of two, at least 4
+  int size() const { return _n; }
+  // In place.  x[0..n*lanes), as [sample][lane] in, [coefficient][lane] out.
+  void operator()(float* x);
+private:
+  const int _n;
+  std::vector<float> _s, _d;			// Each level's smooth and detail halves, before scaling.
+};